@@ -1 +1 @@
-apt-get install libx11-dev libxrandr-dev mesa-common-dev libglew1.5-dev
+apt-get install libx11-dev libxrandr-dev libxcursor-dev libxi-dev libx11-xcb-dev libxcb-randr0-dev mesa-common-dev libglew1.5-dev
@@ -30,6 +30,12 @@ struct OXYGEN_API display : boost::equality_comparable<display>
 	/// If no window is supplied, use the display for the active window
 	static display from_window(window const* w = nullptr);
 
+#if !OS(WINDOWS) && !OS(DARWIN)
+	/// Get display with the largest intersection with a rectangle in root window coordinates,
+	/// or the nearest one to the rectangle if it lays outside of all displays
+	static display from_rect(rectangle<int> const& rect);
+#endif
+
 #if OS(WINDOWS)
 	std::wstring name;
 #elif OS(DARWIN)
@@ -97,6 +103,15 @@ struct OXYGEN_API display : boost::equality_comparable<display>
 
 	/// Current mode
 	mode current_mode() const;
+
+	/// Change display mode to one of modes(), zero mode frequency selects
+	/// the highest refresh rate. Return false if the mode is not supported
+	/// On X Window system only this display output CRTC is changed,
+	/// the mode should fit into the current screen size
+	bool set_mode(mode const& m) const;
+
+	/// Restore display mode changed with set_mode()
+	void restore_mode() const;
 };
 
 }} // aspect::gui
@@ -14,6 +14,13 @@
 #include <X11/Xlib.h>
 #endif
 
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "oxygen/spsc_queue.hpp"
+
 namespace aspect { namespace gui {
 
 class window;
@@ -32,7 +39,11 @@ enum window_style
 struct OXYGEN_API creation_args
 {
 	int left, top, width, height;
-	unsigned bpp, style;
+	unsigned bpp, frequency, style;
+	bool reuse_events;
+
+	/// Display from the `display` option, with empty name if it's not specified
+	display disp;
 
 #if OS(WINDOWS)
 	std::wstring caption;
@@ -85,23 +96,54 @@ typedef NSEvent* event;
 typedef XEvent event;
 #endif
 
+/// Internalized V8 strings for static C strings, cached per isolate by the string address
+/// An instance is used by its isolate thread only
+class OXYGEN_API string_cache
+{
+public:
+	/// Cache of the isolate, created on first use
+	static string_cache& instance(v8::Isolate* isolate);
+
+	/// Drop the cache of the isolate, i.e. on module uninstall
+	static void clear(v8::Isolate* isolate);
+
+	/// Cached string, the C string has to live until clear()
+	v8::Local<v8::String> get(char const* str);
+
+private:
+	explicit string_cache(v8::Isolate* isolate) : isolate_(isolate) {}
+
+	v8::Isolate* isolate_;
+	std::map<char const*, v8::Eternal<v8::String>> strings_;
+};
+
 class OXYGEN_API input_event
 {
 public:
 	explicit input_event(event const& e);
 
+	// Create an UNKNOWN event
+	input_event()
+		: type_and_state_(UNKNOWN)
+		, repeats_(0)
+		, region_(0)
+	{
+	}
+
 	enum event_type
 	{
 		UNKNOWN,
 		KEY_DOWN, KEY_UP, KEY_CHAR,
-		MOUSE_MOVE, MOUSE_WHEEL, MOUSE_DOWN, MOUSE_UP, MOUSE_CLICK,
+		MOUSE_MOVE, MOUSE_WHEEL, MOUSE_DOWN, MOUSE_UP, MOUSE_CLICK, MOUSE_DRAG_START,
+		MOUSE_REGION_ENTER, MOUSE_REGION_LEAVE,
+		EVENT_TYPE_COUNT
 	};
 
 	// Event type
 	event_type type() const { return static_cast<event_type>(type_and_state_ & TYPE_MASK); }
 
 	// Is mouse event
-	bool is_mouse() const { return type() >= MOUSE_MOVE && type() <= MOUSE_CLICK; }
+	bool is_mouse() const { return type() >= MOUSE_MOVE && type() <= MOUSE_REGION_LEAVE; }
 
 	// Is key event
 	bool is_key() const { return type() >= KEY_DOWN && type() <= KEY_CHAR; }
@@ -116,6 +158,10 @@ public:
 	// Shift key is pressed down
 	bool shift() const { return (type_and_state_ & SHIFT_DOWN) != 0; }
 
+	// Modifier keys and mouse buttons state bits: 1 - ctrl, 2 - alt, 4 - shift,
+	// 8 - lbutton, 16 - mbutton, 32 - rbutton, 64 - xbutton1, 128 - xbutton2
+	uint32_t modifiers() const { return (type_and_state_ & STATE_MASK) >> STATE_SHIFT; }
+
 	// Left mouse button is pressed down
 	bool lbutton() const { return (type_and_state_ & LBUTTON_DOWN) != 0; }
 	// Middle mouse button is pressed down
@@ -143,9 +189,25 @@ public:
 
 	// Delta X for mouse wheel
 	int dx() const { return data_.mouse.dx; }
+	int& dx() { return data_.mouse.dx; }
 
 	// Delta Y for mouse wheel
 	int dy() const { return data_.mouse.dy; }
+	int& dy() { return data_.mouse.dy; }
+
+	// Topmost hit-test region id under the mouse, 0 if none, see window_base::set_regions()
+	// The region entered or left for MOUSE_REGION_ENTER and MOUSE_REGION_LEAVE events
+	uint32_t region() const { return region_; }
+	uint32_t& region() { return region_; }
+
+	// Create a mouse event, button number and modifiers are the same as in button() and modifiers()
+	// Delta values are for mouse wheel, or for relative motion in a MOUSE_MOVE event
+	static input_event mouse(event_type type, uint32_t button, uint32_t modifiers,
+		int x, int y, int dx = 0, int dy = 0);
+
+	// Create a key event, native key code is the same as the virtual one
+	static input_event key(event_type type, uint32_t modifiers,
+		uint32_t vk_code, uint32_t scan_code, uint32_t char_code = 0);
 
 public:
 // Key events
@@ -159,27 +221,49 @@ public:
 	// Native key code
 	uint32_t key_code() const { return data_.key.key_code; }
 
+	// Physical key code, independent from keyboard layout, see physical_key enum in keys.hpp
+	uint32_t code() const { return data_.key.code; }
+
 	// Character for KEY_CHAR event
 	uint32_t character() const { return data_.key.char_code; }
 
 	// Click count for MOUSE_CLICK event, repeat count for KEY_DOWN event
 	uint32_t repeats() const { return repeats_; }
+	uint32_t& repeats() { return repeats_; }
 
 public:
 // V8 support
 
 	// Convert input event to V8 value
 	v8::Handle<v8::Value> to_v8(v8::Isolate* isolate) const;
+	v8::Handle<v8::Value> to_v8(v8::Isolate* isolate, string_cache& names) const;
+
+	// Overwrite fields of an object previously filled by to_v8() for the same event type
+	void to_v8(v8::Isolate* isolate, v8::Handle<v8::Object> object) const;
+	void to_v8(v8::Isolate* isolate, v8::Handle<v8::Object> object, string_cache& names) const;
 
 	// Create an input_event form V8 value
 	static input_event from_v8(v8::Isolate* isolate, v8::Handle<v8::Value>);
 
-private:
-	input_event() {}
+public:
+// Binary serialization
+
+	// Number of 32-bit words in a packed event
+	static size_t const PACKED_SIZE = 7;
+
+	// Store the event into PACKED_SIZE words
+	void pack(uint32_t* data) const;
+
+	// Load an event from PACKED_SIZE words
+	static input_event unpack(uint32_t const* data);
 
+	// Event type name, as used in JavaScript
 	static std::string type_to_str(event_type type);
+
+	// Event type from name, UNKNOWN for unrecognized names
 	static event_type type_from_str(std::string const& str);
 
+private:
 	static uint32_t const TYPE_MASK   = 0x000000FF;
 	static uint32_t const TYPE_SHIFT = 0;
 
@@ -226,26 +310,274 @@ private:
 			uint32_t scan_code;
 			uint32_t key_code;
 			uint32_t char_code;
+			uint32_t code;
 		} key;
 	} data_;
 
 	uint32_t repeats_;
+	uint32_t region_;
 };
 
 class event_sink;
-
-class OXYGEN_API window_base : public v8_core::event_emitter
+class event_player;
+class event_route;
+
+/// Event emitter with a table of listeners resolved on registration,
+/// and queues of events posted from native threads to its runtime
+/// All listeners are kept by event_target, it hides the event_emitter methods
+/// and replaces its JavaScript ones, so listeners added with any of them are called
+class OXYGEN_API event_target : public v8_core::event_emitter
 {
-	friend class event_sink;
+	friend class window_base;
 public:
-	explicit window_base(runtime& rt)
-		: rt_(rt)
-		, size_(0, 0)
-		, style_(0)
+	explicit event_target(runtime& rt);
+	~event_target();
+
+	runtime& rt() const { return rt_; }
+
+	/// Window events other than input ones, numbered after input_event::event_type
+	/// to index listeners of both kinds in one table
+	enum window_event
+	{
+		RESIZE_EVENT = input_event::EVENT_TYPE_COUNT,
+		CLOSE_EVENT, MOVE_EVENT, FRAME_EVENT,
+		LISTENER_TABLE_SIZE
+	};
+
+	/// Add event listener
+	void on(v8::Isolate* isolate, std::string const& name, v8::Handle<v8::Function> fn);
+
+	/// Add event listener removed before its first call
+	void once(v8::Isolate* isolate, std::string const& name, v8::Handle<v8::Function> fn);
+
+	/// Remove all event listeners
+	void off(v8::Isolate* isolate, std::string const& name);
+
+	/// Remove the last added event listener fn
+	void remove_listener(v8::Isolate* isolate, std::string const& name, v8::Handle<v8::Function> fn);
+
+	/// Whether the event has listeners
+	bool has(std::string const& name) const;
+
+	/// Call event listeners, return number of called ones
+	size_t emit(v8::Isolate* isolate, std::string const& name, int argc, v8::Handle<v8::Value> argv[]);
+
+	/// JavaScript once(name, fn), removeListener(name, fn),
+	/// removeAllListeners([name]) and emit(name, args...)
+	void once_v8(v8::FunctionCallbackInfo<v8::Value> const& args);
+	void remove_listener_v8(v8::FunctionCallbackInfo<v8::Value> const& args);
+	void remove_all_listeners_v8(v8::FunctionCallbackInfo<v8::Value> const& args);
+	void emit_v8(v8::FunctionCallbackInfo<v8::Value> const& args);
+
+	/// Event queue policy for an event type, applied when the JavaScript thread lags behind
+	enum queue_policy
 	{
+		QUEUE_KEEP,   ///< deliver every event, drop only when the queue is full
+		QUEUE_LATEST, ///< deliver only the latest continuous event of the type, overwritten in place, never dropped
+		QUEUE_DROP,   ///< deliver every event, drop over the limit
+	};
+
+	/// Set queue policy by event and policy names, throws std::invalid_argument for unknown ones
+	void set_queue_policy(std::string const& type, std::string const& policy);
+
+	/// Queue size over which QUEUE_LATEST and QUEUE_DROP events are dropped
+	void set_queue_limit(unsigned limit);
+
+	/// Event queue statistics object with size, limit, capacity, highWater, dropped, coalesced attributes
+	v8::Handle<v8::Object> queue_stats() const;
+
+protected:
+	/// JavaScript object lookup for listener calls, window class by default
+	template<typename Target>
+	void set_js_class()
+	{
+		find_js_object_ = [](v8::Isolate* isolate, event_target* target) -> v8::Handle<v8::Value>
+		{
+			return v8pp::class_<Target>::find_object(isolate, static_cast<Target*>(target));
+		};
 	}
 
-	runtime& rt() const { return rt_; }
+	/// Emit an event without arguments by name in the runtime thread
+	void emit_later(std::string const& type);
+
+	runtime& rt_;
+
+	/// String cache of the runtime isolate, resolved once for event objects
+	string_cache& names_;
+
+	/// Pass pooled event objects to listeners, see creation_args::reuse_events
+	bool reuse_events_;
+
+	// Listener table index for the event name, -1 for names emitted by name
+	static int listener_index(std::string const& name);
+
+	// Checked by the event thread before posting an event
+	bool has_listeners(int index) const { return (listener_mask_ & (1u << index)) != 0; }
+
+	// Event delivered from the event thread to the JavaScript thread
+	struct queued_event
+	{
+		int type;          // listener table index
+		input_event input; // input event for input_event::event_type indices
+		int width, height; // new size for RESIZE_EVENT
+		uint32_t order;    // number of the event among all queued ones, wraps around
+	};
+
+	// Queue an event and schedule a drain unless one is already pending
+	// Producers have to be serialized, see window_base::deliver()
+	void post_event(queued_event ev);
+
+private:
+	typedef v8::Handle<v8::Value> (*js_object_finder)(v8::Isolate* isolate, event_target* target);
+	js_object_finder find_js_object_;
+
+	// Events are queued in two lanes: discrete ones (keys, buttons, close)
+	// and continuous ones (motion, wheel, resize, move, frame). Continuous events
+	// of QUEUE_LATEST types don't take lane slots, each type has one slot overwritten
+	// by the producer, so a flood of motion doesn't delay other events.
+	// A drain dispatches the events of both lanes and the latest slots in order.
+	// Continuous events of the same type preceding a discrete one are merged
+	// into one with accumulated deltas, so a backlog of them doesn't delay it.
+	static size_t const EVENT_QUEUE_SIZE = 1024;
+	spsc_queue<queued_event, EVENT_QUEUE_SIZE> discrete_events_;
+	spsc_queue<queued_event, EVENT_QUEUE_SIZE> continuous_events_;
+	uint32_t event_order_;
+	boost::atomic<bool> events_pending_;
+
+	// Calls scheduled in the runtime thread hold a weak reference to this target,
+	// they are skipped if it is destroyed before, i.e. a route closed and collected
+	boost::shared_ptr<event_target*> self_;
+	static void scheduled_drain(boost::weak_ptr<event_target*> const& self);
+	static void scheduled_event(boost::weak_ptr<event_target*> const& self, std::string const& type);
+
+	struct latest_slot
+	{
+		queued_event event;
+		bool is_set;
+	};
+	latest_slot latest_events_[LISTENER_TABLE_SIZE];
+
+	// Taken by the producer to post an event and by a drain to take a consistent
+	// snapshot of the latest slots and the lane sizes
+	boost::atomic<bool> queue_lock_;
+
+	static bool is_continuous(int type);
+
+	// Queue policies by listener table index, and limit for the continuous lane
+	boost::atomic<int> queue_policies_[LISTENER_TABLE_SIZE];
+	boost::atomic<size_t> queue_limit_;
+
+	// Written by the event thread
+	boost::atomic<size_t> queue_high_water_;
+	boost::atomic<uint64_t> queue_dropped_;
+	boost::atomic<uint64_t> queue_coalesced_;
+
+//V8 handlers
+	void drain_events();
+	void dispatch_event(queued_event const& ev);
+	void on_event_v8(std::string type);
+
+	// Listener functions, used by the JavaScript thread only
+	struct listener
+	{
+		v8::Persistent<v8::Function, v8::CopyablePersistentTraits<v8::Function>> fn;
+		bool once;
+	};
+	typedef std::vector<listener> listener_list;
+
+	// Listeners of the table events by index, and of other events by name
+	listener_list listeners_[LISTENER_TABLE_SIZE];
+	std::map<std::string, listener_list> named_listeners_;
+	boost::atomic<uint32_t> listener_mask_;
+
+	void add_listener(v8::Isolate* isolate, std::string const& name, v8::Handle<v8::Function> fn, bool once);
+	listener_list* find_listeners(std::string const& name);
+
+	// Update the listener mask for the event thread after changes of the table listeners
+	void update_listener_mask(int index);
+
+	// Call listeners from the table, returns false if there are none
+	bool call_listeners(int index, int argc, v8::Handle<v8::Value> argv[]);
+
+	// Call listeners, once ones are removed before the call. An exception
+	// thrown by a listener is reported and doesn't stop other listeners
+	size_t call_listeners(listener_list& listeners, int argc, v8::Handle<v8::Value> argv[]);
+
+	// Input event object for a listener call, taken round robin from a small per type pool
+	v8::Handle<v8::Value> event_object(input_event const& inp_e);
+
+	static size_t const EVENT_POOL_SIZE = 4;
+	typedef v8::Persistent<v8::Object, v8::CopyablePersistentTraits<v8::Object>> event_object_ref;
+	std::vector<event_object_ref> event_pool_[input_event::EVENT_TYPE_COUNT];
+	size_t event_pool_next_[input_event::EVENT_TYPE_COUNT];
+};
+
+class OXYGEN_API window_base : public event_target
+{
+	friend class event_sink;
+	friend class event_player;
+	friend class event_route;
+public:
+	explicit window_base(runtime& rt);
+	~window_base();
+
+	/// Window number, unique in the process, stored in event recordings
+	uint32_t id() const { return id_; }
+
+	/// Record events of all windows into a file, throws std::runtime_error on failure
+	static void start_recording(std::string const& filename);
+
+	/// Stop recording, return number of recorded events
+	static uint64_t stop_recording();
+
+	/// Replay a recording into this window, live input is ignored until the replay end.
+	/// Speed is a time scale, 0 replays as fast as possible. Only events of the window
+	/// with non-zero id are replayed. Emits `replayend` event when finished
+	void replay(std::string const& filename, double speed, uint32_t window_id);
+
+	/// replay(filename [, speed = 1 [, window_id = 0]]) for JavaScript
+	void replay_v8(v8::FunctionCallbackInfo<v8::Value> const& args);
+
+	/// Stop replay
+	void stop_replay();
+
+	/// Replace hit-test regions with an Int32Array of records: id, z, left, top, width, height
+	/// Region id 0 is reserved for no region. The region with the highest z is the topmost,
+	/// the later one for equal z. The event thread tags mouse events with the topmost region
+	/// under the pointer and emits `regionenter` and `regionleave` events on transitions,
+	/// including those caused by the new regions under the last pointer position
+	void set_regions(v8::Handle<v8::Value> regions);
+
+	/// Remove all hit-test regions
+	void clear_regions();
+
+	/// Topmost hit-test region id at a point, 0 if none
+	uint32_t region_at(int x, int y) const;
+
+	/// Shared state arrays are backed by native memory in externalized array buffers.
+	/// A transfer from JavaScript detaches the array, the event thread keeps writing
+	/// the memory, which is freed after the window when the buffer is garbage collected
+
+	/// Keyboard state shared with JavaScript as Uint32Array, updated by the event thread:
+	///   words 0..7 - bitset of pressed keys, indexed by the key scan code
+	///   word 8     - modifier keys and mouse buttons state, see input_event::modifiers()
+	v8::Handle<v8::Uint32Array> keyboard_state() const;
+
+	/// Pointer state shared with JavaScript as Int32Array, updated by the event thread
+	/// Wheel and motion deltas are accumulated as running totals with wrap around,
+	/// a reader gets the deltas since its last read by subtracting the previous totals
+	/// The sequence is a lock: odd while an update is written, a reader retries
+	/// when it reads an odd sequence or the sequence changes during the read
+	enum pointer_state_index
+	{
+		POINTER_X, POINTER_Y,             ///< latest pointer position
+		POINTER_BUTTONS,                  ///< mouse buttons state bits, see input_event::modifiers()
+		POINTER_WHEEL_X, POINTER_WHEEL_Y, ///< accumulated wheel deltas
+		POINTER_MOTION_X, POINTER_MOTION_Y, ///< accumulated motion deltas
+		POINTER_SEQUENCE,                 ///< update sequence, increased by 2 for each update
+		POINTER_STATE_SIZE
+	};
+	v8::Handle<v8::Int32Array> pointer_state() const;
 
 	// Window size
 	box<int> const& size() const { return size_; }
@@ -262,21 +594,108 @@ protected:
 	void on_resize(box<int> const& new_size);
 	void on_screen_change();
 	void on_input(input_event const& e);
+	void on_event(window_event type);
 	void on_event(std::string const& type);
 
-	runtime& rt_;
+	/// Release all keys in the keyboard state, i.e. on focus loss
+	void reset_keyboard_state();
+
+	/// Pointer left the window at a position, posts `regionleave` event if it was in a region
+	void on_pointer_leave(int x, int y);
+
 	box<int> size_;
 	unsigned style_;
 
 private:
-//V8 handlers
-	void on_resize_v8(box<int> new_size);
-	void on_input_v8(input_event e);
-	void on_event_v8(std::string type);
+	uint32_t const id_;
+
+	// Events from the platform and from a replay thread. Each one runs
+	// under the post lock, it serializes the state updates, sinks and posting
+	void process_resize(box<int> const& new_size);
+	void process_input(input_event const& inp_e);
+	void process_event(window_event type);
+
+	std::unique_ptr<event_player> player_;
+	boost::atomic<bool> replaying_;
+
+	// Post an event to the route of its type or to this window if there are listeners
+	// Called under the post lock
+	void deliver(queued_event const& ev);
+	boost::atomic<bool> post_lock_;
+
+	// Event routes by listener table index, changed under the post lock
+	event_route* routes_[LISTENER_TABLE_SIZE];
 
-private:
 	typedef std::list<event_sink*> event_sinks;
 	event_sinks event_sinks_;
+
+	void update_keyboard_state(input_event const& inp_e);
+	void update_pointer_state(input_event const& inp_e);
+
+	// Uniform grid index of hit-test regions, immutable after construction
+	class region_grid;
+	typedef boost::shared_ptr<region_grid const> region_grid_ptr;
+
+	// Loaded by the event thread and replaced by JavaScript with atomic shared_ptr access
+	region_grid_ptr regions() const;
+	void replace_regions(region_grid_ptr const& regions);
+
+	// Tag a mouse event with its region, post region transitions
+	void hit_test(input_event& inp_e);
+
+	// Post region transitions to a region under the pointer, called under the post lock
+	void change_pointer_region(uint32_t region, uint32_t button, uint32_t modifiers, int x, int y);
+
+	region_grid_ptr regions_;
+
+	// Changed under the post lock, the pointer is inside after a mouse event until it leaves
+	uint32_t pointer_region_;
+	bool pointer_inside_;
+
+	static size_t const KEYBOARD_STATE_SIZE = 256 / 32 + 1;
+	static size_t const KEYBOARD_MODIFIERS = 256 / 32;
+
+	// Written under the post lock, native memory in externalized V8 array buffers
+	v8::Persistent<v8::Uint32Array> keyboard_state_;
+	uint32_t* keyboard_state_data_;
+
+	v8::Persistent<v8::Int32Array> pointer_state_;
+	int32_t* pointer_state_data_;
+	bool pointer_moved_;
+};
+
+/// Receives events of chosen types from a window in another runtime, i.e. in a worker
+/// isolate, with its own queue. Other events of the window stay in the window runtime
+class OXYGEN_API event_route : public event_target
+{
+	friend class window_base;
+public:
+	/// Arguments: window id, array of event type names
+	/// Throws std::invalid_argument for unknown window or event types,
+	/// std::runtime_error if a type is already routed
+	explicit event_route(v8::FunctionCallbackInfo<v8::Value> const& args);
+	~event_route() { close(); }
+
+	/// Stop routing, the window runtime gets the events again
+	void close();
+
+	event_route& on(std::string const& name, v8::Handle<v8::Function> fn)
+	{
+		event_target::on(rt_.isolate(), name, fn);
+		return *this;
+	}
+
+	event_route& off(std::string const& name)
+	{
+		event_target::off(rt_.isolate(), name);
+		return *this;
+	}
+
+	uint32_t window_id() const { return window_id_; }
+
+private:
+	uint32_t window_id_;
+	window_base* window_; // guarded by the window registry mutex
 };
 
 class OXYGEN_API event_sink
@@ -0,0 +1,72 @@
+#ifndef OXYGEN_GUI_VIRTUAL_HPP_INCLUDED
+#define OXYGEN_GUI_VIRTUAL_HPP_INCLUDED
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "jsx/geometry.hpp"
+#include "oxygen/gui.hpp"
+
+namespace aspect { namespace gui {
+
+/// Window without a native window system counterpart. Delivers events
+/// injected from JavaScript or produced by a generator thread through
+/// the same window_base event path as native windows, i.e. for load tests.
+/// Injected and generated events are serialized by the window_base post lock
+class OXYGEN_API virtual_window : public window_base
+{
+public:
+	/// Options object attributes: width, height, reuseEvents
+	explicit virtual_window(v8::FunctionCallbackInfo<v8::Value> const& args);
+	~virtual_window() { destroy(); }
+
+	/// Stop event generator and replay
+	void destroy();
+
+	virtual_window& on(std::string const& name, v8::Handle<v8::Function> fn)
+	{
+		window_base::on(rt_.isolate(), name, fn);
+		return *this;
+	}
+
+	virtual_window& off(std::string const& name)
+	{
+		window_base::off(rt_.isolate(), name);
+		return *this;
+	}
+
+	/// Deliver an input event
+	void inject(input_event const& e);
+
+	/// Change the window size and deliver resize event
+	void resize(int width, int height);
+
+	/// Start event generator thread, replacing the running one
+	/// Options object attributes:
+	///   type  - input event type name, mousemove by default: keydown, keyup, char,
+	///           mousemove, mousewheel, mousedown, mouseup or mouseclick.
+	///           Throws std::invalid_argument for other types
+	///   rate  - events per second, 0 to generate as fast as possible
+	///   count - number of events, 0 to generate until stop_generator()
+	void generate(v8::FunctionCallbackInfo<v8::Value> const& args);
+
+	/// Stop event generator thread
+	void stop_generator();
+
+	/// Number of events produced by the generator
+	double generated() const { return static_cast<double>(generated_); }
+
+private:
+	void run_generator(input_event::event_type type, double rate, uint64_t count);
+	static input_event make_event(input_event::event_type type, uint64_t n, box<int> const& size);
+
+	bool destroyed_;
+	boost::mutex size_mutex_; // size_ is read by the generator thread
+	boost::thread generator_;
+	boost::atomic<uint64_t> generated_;
+};
+
+}} // aspect::gui
+
+#endif // OXYGEN_GUI_VIRTUAL_HPP_INCLUDED
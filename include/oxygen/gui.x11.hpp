@@ -4,16 +4,81 @@
 #include <X11/Xlib.h>
 #include <X11/extensions/Xrandr.h>
 
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+
 #include "jsx/geometry.hpp"
 #include "oxygen/gui.hpp"
 
 namespace aspect { namespace gui {
 
+/// Connection for requests from the JavaScript thread: window creation and configuration,
+/// display queries. Events sent to a window creator, i.e. WM_DELETE_WINDOW, come on it
 extern Display* g_display;
+/// Connection owned by the event thread, window events are selected on it
+extern Display* g_event_display;
 extern int g_screen;
 extern Window g_root;
 extern XIM g_input_method;
 
+/// Display connection lock with contention statistics. Owners of display_lock
+/// take the mutex before the Xlib display lock, a failed try_lock counts contention
+struct lock_stats
+{
+	boost::recursive_mutex mutex;
+	boost::atomic<uint64_t> locks;     ///< number of lock acquisitions
+	boost::atomic<uint64_t> contended; ///< number of acquisitions waited for another thread
+	boost::atomic<uint64_t> wait_us;   ///< total wait time in contended acquisitions, microseconds
+};
+
+extern lock_stats g_display_lock_stats;
+extern lock_stats g_event_display_lock_stats;
+
+/// Window creation latency statistics, from window constructor to the first MapNotify
+struct creation_stats
+{
+	boost::atomic<uint64_t> windows;    ///< number of mapped windows
+	boost::atomic<uint64_t> map_us;     ///< total time to map in microseconds
+	boost::atomic<uint64_t> max_map_us; ///< maximum time to map in microseconds
+};
+
+extern creation_stats g_creation_stats;
+
+/// Number of X resources used by windows
+struct resource_stats
+{
+	boost::atomic<int> windows;        ///< number of windows
+	boost::atomic<int> colormaps;      ///< number of shared colormaps, one per visual
+	boost::atomic<int> cursors;        ///< number of shared cursors
+	boost::atomic<int> input_contexts; ///< number of input contexts, created on first focus
+};
+
+extern resource_stats g_resource_stats;
+
+/// Scoped Xlib display lock, gathers lock contention statistics
+/// Xlib calls made by the owner thread under the lock don't lock the display again
+/// The event thread is woken on unlock when the owner has left events in the Xlib queue
+class display_lock : boost::noncopyable
+{
+public:
+	display_lock(Display* display, lock_stats& stats);
+
+	/// Try to lock without waiting, see owns_lock()
+	display_lock(Display* display, lock_stats& stats, boost::try_to_lock_t);
+
+	~display_lock();
+
+	bool owns_lock() const { return lock_.owns_lock(); }
+
+private:
+	Display* display_;
+	boost::unique_lock<boost::recursive_mutex> lock_;
+};
+
 struct randr_info {
 	bool is_available;
 	int event_base;
@@ -24,6 +89,31 @@ struct randr_info {
 
 extern randr_info randr;
 
+/// Cached keyboard mapping entry for a keycode
+struct key_info
+{
+	static unsigned const levels = 4;
+
+	KeySym syms[levels]; ///< keysym for each shift level in the first group
+	uint32_t key_code;   ///< virtual key code, see key_code enum in keys.hpp
+	uint32_t code;       ///< physical key code, see physical_key enum in keys.hpp
+	char const* name;    ///< interned keysym name for the virtual key code
+};
+
+/// Build a new keyboard mapping table for keycodes 8..255 and replace the current one
+/// Called on init and on MappingNotify, XkbMapNotify, XkbNewKeyboardNotify events
+/// Tables are reference counted, a replaced one lives while a reader holds it
+void update_keymap();
+
+/// Cached keyboard mapping entry for a keycode
+key_info keymap(unsigned keycode);
+
+/// Keysym name for a key, cached when the keysym matches the keycode mapping
+char const* keysym_name(unsigned keycode, KeySym key_sym);
+
+/// Keysym name as V8 string, cached in the isolate for keysyms of the keycode mapping
+v8::Local<v8::String> keysym_string(v8::Isolate* isolate, string_cache& names, unsigned keycode, KeySym key_sym);
+
 class OXYGEN_API window : public window_base
 {
 public:
@@ -32,6 +122,10 @@ public:
 
 	explicit window(v8::FunctionCallbackInfo<v8::Value> const& args);
 
+	/// Keep count of created, but not mapped windows for the args style and bpp
+	/// New windows with the same style and bpp are taken from the pool
+	static void reserve(creation_args const& args, size_t count);
+
 	~window() { destroy(); }
 
 	void destroy();
@@ -54,13 +148,41 @@ public:
 
 	void show_mouse_cursor(bool show);
 	void set_stock_cursor(cursor_id id);
+
+	/// Load a cursor from the cursor theme by name, or from a Xcursor file
+	/// if the name contains '/'. Return cursor id for set_image_cursor()
+	/// Cursors are cached by name and live until cleanup()
+	static unsigned load_cursor(std::string const& name);
+
+	/// Create a cursor from width * height premultiplied ARGB pixels, of pixel_count available
+	/// Return cursor id for set_image_cursor(), the cursor lives until cleanup()
+	static unsigned create_cursor(unsigned width, unsigned height, int hot_x, int hot_y,
+		uint32_t const* pixels, size_t pixel_count);
+
+	/// Set the cursor loaded or created before
+	void set_image_cursor(unsigned id);
 	void capture_mouse(bool capture);
 	void set_mouse_pos(int x, int y);
+
+	/// Lock the pointer in the window: confine it with a grab, hide the cursor
+	/// and deliver mousemove events with unaccelerated relative motion in dx, dy
+	/// from XInput2 raw events. Return false if the pointer can't be grabbed
+	bool lock_pointer();
+	void unlock_pointer();
 	void show(bool visible);
 	void set_focus();
-	void toggle_fullscreen() {}
+	void toggle_fullscreen();
+
+	/// Set fullscreen state with EWMH _NET_WM_STATE_FULLSCREEN, bypass compositor in fullscreen
+	void set_fullscreen(bool fullscreen);
+	/// Fullscreen state, also changed by the window manager
+	bool is_fullscreen() const;
 
+	/// Window rectangle in root window coordinates, cached from ConfigureNotify events
 	rectangle<int> rect() const;
+
+	/// Query window rectangle from the X server and update the cached one
+	rectangle<int> query_rect();
 	void set_rect(rectangle<int> const& rect);
 
 	void show_frame(bool show) { }
@@ -69,28 +191,74 @@ public:
 	void load_icon_from_file(std::string const&) { }
 	void use_as_splash_screen(std::string filename) { }
 
+	/// Set thresholds for mouseclick and dragstart events synthesized from button events:
+	/// maximum time between clicks in milliseconds and pointer distances in pixels
+	/// to count a click as a multiple one and to start a drag
+	static void set_click_thresholds(unsigned time, unsigned distance, unsigned drag_distance);
+
 private:
 	void create(creation_args const& args);
 	void _init();
-	void create_hidden_cursor();
-	bool switch_to_fullscreen(display::mode const& mode);
 	void _cleanup();
 
+	/// Flush g_display on the first change in a main loop turn, and once
+	/// at the end of the turn for later changes, to coalesce cursor changes
+	void schedule_flush();
+	static void flush();
+
 	void process(XEvent& event);
+	void process_raw_motion(double dx, double dy);
+
+	/// Dispatch an event to its window, without the display lock held
+	static void dispatch(XEvent& event);
+
+	/// Synthesize mouseclick and dragstart events from button and motion events
+	void process_button(XEvent const& event, input_event const& e);
+	void process_drag(input_event const& e);
+	/// Forget the pressed button when its release will not be delivered
+	void reset_press();
+	static void process_pending_events();
+	static void process_request_events();
 	static void process_events();
 
 private:
 	Window window_;
 	Atom atom_close_;
-	int previous_video_mode_;
-	Cursor hidden_cursor_, current_cursor_;
+	Cursor cursor_; ///< current cursor, restored when the hidden one is shown
+	mutable boost::atomic<bool> fullscreen_;
+	mutable boost::atomic<bool> wm_state_changed_; ///< _NET_WM_STATE changed, read it in is_fullscreen()
+	display mode_display_; ///< display with the mode changed for fullscreen
+	bool mode_changed_;
 	XIC input_context_;
 	XVisualInfo current_visual_;
+	boost::chrono::steady_clock::time_point create_time_;
+	bool mapped_;
 
 	uint32_t pressed_key_code_;
 	uint32_t pressed_char_code_;
+
+	// Window rectangle in root coordinates, updated in the event thread
+	mutable boost::mutex rect_mutex_;
+	rectangle<int> rect_;
+	Window parent_; // reparenting window manager frame, or root window
+	int parent_x_, parent_y_; // window position in the parent, for root position changes in real ConfigureNotify
+
+	// Last pointer position and modifiers, for relative motion in the pointer lock
+	int pointer_x_, pointer_y_;
+	uint32_t modifiers_;
+	double raw_dx_, raw_dy_; // fractional remainders of raw motion
 	boost::atomic<int> capture_count_;
 
+	// Click and drag state, updated in the event thread
+	uint32_t press_button_;  // button pressed in the window, 0 if none
+	int press_x_, press_y_;
+	uint32_t press_count_;   // click count of the press
+	bool dragging_;
+	uint32_t click_button_;  // last click, to count multiple clicks
+	int click_x_, click_y_;
+	Time click_time_;
+	uint32_t click_count_;
+
 	friend class input_event; // to access input_context_
 };
 
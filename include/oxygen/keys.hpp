@@ -257,6 +257,51 @@ enum key_code
 #endif
 };
 
+// Physical key codes, independent from the keyboard layout.
+// Named after the US keyboard key in that location, like DOM KeyboardEvent.code
+enum physical_key
+{
+	CODE_UNKNOWN = 0,
+
+	CODE_ESCAPE,
+	CODE_F1, CODE_F2, CODE_F3, CODE_F4, CODE_F5, CODE_F6,
+	CODE_F7, CODE_F8, CODE_F9, CODE_F10, CODE_F11, CODE_F12,
+	CODE_F13, CODE_F14, CODE_F15, CODE_F16, CODE_F17, CODE_F18,
+	CODE_F19, CODE_F20, CODE_F21, CODE_F22, CODE_F23, CODE_F24,
+
+	CODE_BACKQUOTE,
+	CODE_DIGIT_1, CODE_DIGIT_2, CODE_DIGIT_3, CODE_DIGIT_4, CODE_DIGIT_5,
+	CODE_DIGIT_6, CODE_DIGIT_7, CODE_DIGIT_8, CODE_DIGIT_9, CODE_DIGIT_0,
+	CODE_MINUS, CODE_EQUAL, CODE_BACKSPACE,
+
+	CODE_TAB,
+	CODE_Q, CODE_W, CODE_E, CODE_R, CODE_T, CODE_Y, CODE_U, CODE_I, CODE_O, CODE_P,
+	CODE_BRACKET_LEFT, CODE_BRACKET_RIGHT, CODE_BACKSLASH,
+
+	CODE_CAPS_LOCK,
+	CODE_A, CODE_S, CODE_D, CODE_F, CODE_G, CODE_H, CODE_J, CODE_K, CODE_L,
+	CODE_SEMICOLON, CODE_QUOTE, CODE_ENTER,
+
+	CODE_SHIFT_LEFT, CODE_INTL_BACKSLASH,
+	CODE_Z, CODE_X, CODE_C, CODE_V, CODE_B, CODE_N, CODE_M,
+	CODE_COMMA, CODE_PERIOD, CODE_SLASH, CODE_SHIFT_RIGHT,
+
+	CODE_CONTROL_LEFT, CODE_META_LEFT, CODE_ALT_LEFT, CODE_SPACE,
+	CODE_ALT_RIGHT, CODE_META_RIGHT, CODE_CONTEXT_MENU, CODE_CONTROL_RIGHT,
+
+	CODE_PRINT_SCREEN, CODE_SCROLL_LOCK, CODE_PAUSE,
+	CODE_INSERT, CODE_HOME, CODE_PAGE_UP,
+	CODE_DELETE, CODE_END, CODE_PAGE_DOWN,
+	CODE_ARROW_UP, CODE_ARROW_LEFT, CODE_ARROW_DOWN, CODE_ARROW_RIGHT,
+
+	CODE_NUM_LOCK, CODE_NUMPAD_DIVIDE, CODE_NUMPAD_MULTIPLY, CODE_NUMPAD_SUBTRACT,
+	CODE_NUMPAD_ADD, CODE_NUMPAD_ENTER, CODE_NUMPAD_DECIMAL, CODE_NUMPAD_EQUAL,
+	CODE_NUMPAD_0, CODE_NUMPAD_1, CODE_NUMPAD_2, CODE_NUMPAD_3, CODE_NUMPAD_4,
+	CODE_NUMPAD_5, CODE_NUMPAD_6, CODE_NUMPAD_7, CODE_NUMPAD_8, CODE_NUMPAD_9,
+
+	CODE_COUNT
+};
+
 }} // aspect::gui
 
 #endif // OXYGEN_KEYS_HPP_INCLUDED
@@ -28,3 +28,4 @@
 #else
 #include "oxygen/gui.x11.hpp"
 #endif
+#include "oxygen/gui.virtual.hpp"
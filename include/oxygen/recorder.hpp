@@ -0,0 +1,97 @@
+#ifndef OXYGEN_RECORDER_HPP_INCLUDED
+#define OXYGEN_RECORDER_HPP_INCLUDED
+
+#include <cstdio>
+
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "oxygen/gui.hpp"
+
+namespace aspect { namespace gui {
+
+/// Window event in a recording file. The file starts with the magic and version
+/// words followed by fixed size 44 byte records, all in the native byte order
+#pragma pack(push, 4)
+struct event_record
+{
+	static uint32_t const MAGIC = 0x5249584F; // "OXIR" in little endian
+	static uint32_t const VERSION = 1;
+
+	uint64_t time_us; ///< time since the recording start, microseconds
+	uint32_t window;  ///< window_base::id() of the event target
+	uint32_t type;    ///< window_base listener table index
+	uint32_t data[input_event::PACKED_SIZE]; ///< packed input event, or width and height for resize
+};
+#pragma pack(pop)
+
+static_assert(sizeof(event_record) == 8 + 4 * (2 + input_event::PACKED_SIZE), "event record is padded");
+
+/// Appends window events into a binary file. Records are buffered,
+/// full buffers are written by a background thread
+class OXYGEN_API event_recorder : boost::noncopyable
+{
+public:
+	/// Create a recording file, throws std::runtime_error on failure
+	explicit event_recorder(std::string const& filename);
+
+	/// Write the buffered records, stop the writer thread and close the file
+	~event_recorder();
+
+	/// Append an event record stamped with the current time, thread-safe
+	void append(event_record& record);
+
+	/// Number of appended records
+	uint64_t count() const { return count_; }
+
+private:
+	void write_buffers();
+
+	static size_t const BUFFER_RECORDS = 4096;
+
+	typedef std::vector<event_record> record_buffer;
+
+	boost::mutex mutex_;
+	boost::condition_variable buffers_full_;
+	FILE* file_;
+	record_buffer buffer_;
+	std::vector<record_buffer> full_buffers_; // waiting for the writer
+	std::vector<record_buffer> free_buffers_; // written, reused by append()
+	bool stopping_;
+	boost::chrono::steady_clock::time_point start_;
+	boost::atomic<uint64_t> count_;
+	boost::thread writer_;
+};
+
+/// Replays a recording into a window from a background thread
+class OXYGEN_API event_player : boost::noncopyable
+{
+public:
+	/// Open a recording file, throws std::runtime_error on failure
+	/// Speed is a time scale, 0 replays as fast as possible.
+	/// Records of all windows are replayed unless the window id is not 0
+	event_player(window_base& target, std::string const& filename, double speed, uint32_t window_id);
+
+	/// Stop the replay thread
+	~event_player();
+
+	bool finished() const { return finished_; }
+
+private:
+	void run();
+
+	window_base& target_;
+	FILE* file_;
+	double speed_;
+	uint32_t window_id_;
+	boost::atomic<bool> finished_;
+	boost::thread thread_;
+};
+
+}} // aspect::gui
+
+#endif // OXYGEN_RECORDER_HPP_INCLUDED
@@ -0,0 +1,82 @@
+#ifndef OXYGEN_SPSC_QUEUE_HPP_INCLUDED
+#define OXYGEN_SPSC_QUEUE_HPP_INCLUDED
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace aspect { namespace gui {
+
+/// Fixed capacity lock-free queue for a single producer and a single consumer thread
+/// Items are copied by value into preallocated storage, no allocations after construction
+template<typename T, size_t Capacity>
+class spsc_queue : boost::noncopyable
+{
+	static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of 2");
+public:
+	static size_t const capacity = Capacity;
+
+	spsc_queue()
+		: head_(0)
+		, tail_(0)
+	{
+	}
+
+	/// Append an item, returns false if the queue is full. Producer thread only
+	bool push(T const& item)
+	{
+		size_t const tail = tail_.load(boost::memory_order_relaxed);
+		if (tail - head_.load(boost::memory_order_acquire) == Capacity)
+		{
+			return false;
+		}
+		items_[tail & MASK] = item;
+		tail_.store(tail + 1, boost::memory_order_release);
+		return true;
+	}
+
+	/// Remove the oldest item, returns false if the queue is empty. Consumer thread only
+	bool pop(T& item)
+	{
+		size_t const head = head_.load(boost::memory_order_relaxed);
+		if (head == tail_.load(boost::memory_order_acquire))
+		{
+			return false;
+		}
+		item = items_[head & MASK];
+		head_.store(head + 1, boost::memory_order_release);
+		return true;
+	}
+
+	/// Oldest item, valid until pop(), nullptr if the queue is empty. Consumer thread only
+	T const* front() const
+	{
+		size_t const head = head_.load(boost::memory_order_relaxed);
+		if (head == tail_.load(boost::memory_order_acquire))
+		{
+			return nullptr;
+		}
+		return &items_[head & MASK];
+	}
+
+	/// Number of queued items, exact only in the producer or the consumer thread
+	size_t size() const
+	{
+		return tail_.load(boost::memory_order_acquire) - head_.load(boost::memory_order_acquire);
+	}
+
+	bool empty() const { return size() == 0; }
+
+private:
+	static size_t const MASK = Capacity - 1;
+
+	T items_[Capacity];
+
+	// Keep the indices on separate cache lines, they are written by different threads
+	boost::atomic<size_t> head_;
+	char head_padding_[64 - sizeof(boost::atomic<size_t>)];
+	boost::atomic<size_t> tail_;
+};
+
+}} // aspect::gui
+
+#endif // OXYGEN_SPSC_QUEUE_HPP_INCLUDED
@@ -16,10 +16,15 @@
             'defines': ['OXYGEN_EXPORTS'],
             'sources': [
                 'include/oxygen/gui.hpp',
+                'include/oxygen/gui.virtual.hpp',
                 'include/oxygen/display.hpp',
                 'include/oxygen/keys.hpp',
+                'include/oxygen/recorder.hpp',
+                'include/oxygen/spsc_queue.hpp',
                 'include/oxygen/oxygen.hpp',
                 'src/gui.cpp',
+                'src/gui.virtual.cpp',
+                'src/recorder.cpp',
                 'src/oxygen.cpp',
             ],
             'conditions': [
@@ -48,7 +53,7 @@
                         'src/gui.x11.cpp',
                         'include/oxygen/gui.x11.hpp',
                     ],
-                    'libraries': ['-lX11', '-lXrandr', '-lGL'],
+                    'libraries': ['-lX11', '-lXcursor', '-lXi', '-lX11-xcb', '-lxcb', '-lxcb-randr', '-lXrandr', '-lGL'],
                 }],
             ],
         },
@@ -0,0 +1,88 @@
+pragma("event-queue");
+
+// Event dispatch benchmark: native events generated by a VirtualWindow thread
+// are dispatched through the pre-resolved listener table. The same number of
+// emit() calls from JavaScript is the baseline: each call resolves listeners
+// by the event name and converts the event object, as dispatch did before the table.
+// Run with the runtime, i.e. as test.js, and compare the reported times per event.
+
+var oxygen = require("oxygen");
+
+// Number of events and of listeners for the event type
+var COUNT = 200000;
+var LISTENERS = 1;
+
+function report(name, calls, ms, dropped)
+{
+	console.log("%s: %d events in %s ms, %d events/s, %s us per event, %d dropped",
+		name, calls, ms.toFixed(1), Math.round(calls / ms * 1000), (ms * 1000 / calls).toFixed(3), dropped);
+}
+
+function bench_table(done)
+{
+	var window = new oxygen.VirtualWindow({ width: 800, height: 600 });
+	var calls = 0, start = 0, end = 0, generated = false;
+
+	function finish()
+	{
+		var stats = window.queueStats();
+		if (!generated || calls + stats.dropped < COUNT) return;
+		generated = false;
+		report("listener table", calls, end - start, stats.dropped);
+		window.destroy();
+		done();
+	}
+
+	for (var i = 0; i < LISTENERS; ++i)
+	{
+		window.on("mousedown", function(e)
+		{
+			if (e.x < 0) throw new Error("unexpected event");
+		});
+	}
+	// counted last, after the measured listeners
+	window.on("mousedown", function(e)
+	{
+		if (calls++ === 0) start = Date.now();
+		end = Date.now();
+		if (generated) finish();
+	});
+	window.on("generateend", function()
+	{
+		generated = true;
+		finish();
+	});
+
+	// mousedown events are discrete and never coalesced
+	window.generate({ type: "mousedown", count: COUNT });
+}
+
+function bench_emit(done)
+{
+	var window = new oxygen.VirtualWindow({ width: 800, height: 600 });
+	var event = { type: "mousedown", button: 1, x: 0, y: 0, modifiers: {} };
+
+	for (var i = 0; i < LISTENERS; ++i)
+	{
+		window.on("mousedown", function(e)
+		{
+			if (e.x < 0) throw new Error("unexpected event");
+		});
+	}
+
+	var start = Date.now();
+	for (var n = 0; n < COUNT; ++n)
+	{
+		event.x = n % 800;
+		window.emit("mousedown", event);
+	}
+	report("emit by name", COUNT, Date.now() - start, 0);
+	window.destroy();
+	done();
+}
+
+console.log("dispatch benchmark: %d events, %d listeners", COUNT, LISTENERS);
+bench_table(function()
+{
+	bench_emit(function() {});
+});
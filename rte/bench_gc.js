@@ -0,0 +1,63 @@
+pragma("event-queue");
+
+// Garbage collection pauses during event dispatch, with and without
+// the `reuseEvents` option. A VirtualWindow generator thread produces
+// the events, gcStats() deltas are reported for each run.
+// Run with the runtime, i.e. as test.js, and compare the reported pauses.
+
+var oxygen = require("oxygen");
+
+// Number of events in each run
+var COUNT = 500000;
+
+function gc_delta(before, after)
+{
+	return {
+		count: after.count - before.count,
+		time: after.time - before.time,
+		maxTime: after.maxTime,
+	};
+}
+
+function run(reuse_events, done)
+{
+	var window = new oxygen.VirtualWindow({ width: 800, height: 600, reuseEvents: reuse_events });
+	var calls = 0, sum = 0, start = 0, generated = false;
+	var gc_before = window.gcStats();
+
+	function finish()
+	{
+		var stats = window.queueStats();
+		if (!generated || calls + stats.dropped < COUNT) return;
+		generated = false;
+
+		var ms = Date.now() - start;
+		var gc = gc_delta(gc_before, window.gcStats());
+		console.log("reuseEvents %s: %d events in %d ms, %d dropped, %d GCs, %s ms paused, longest pause %s ms (since install)",
+			reuse_events, calls, ms, stats.dropped, gc.count, gc.time.toFixed(2), gc.maxTime.toFixed(2));
+		window.destroy();
+		done();
+	}
+
+	// A listener reading the event, it doesn't keep the object
+	window.on("mousedown", function(e)
+	{
+		if (calls++ === 0) start = Date.now();
+		sum += e.x + e.y;
+		if (generated) finish();
+	});
+	window.on("generateend", function()
+	{
+		generated = true;
+		finish();
+	});
+
+	// mousedown events are discrete and never coalesced
+	window.generate({ type: "mousedown", count: COUNT });
+}
+
+console.log("GC benchmark: %d events per run", COUNT);
+run(false, function()
+{
+	run(true, function() {});
+});
@@ -161,4 +161,33 @@ display::mode display::current_mode() const
 	return result;
 }
 
+bool display::set_mode(mode const& m) const
+{
+	// Find matching mode, with the highest refresh rate for zero frequency
+	CGDisplayModeRef best = nullptr;
+	unsigned frequency = 0;
+
+	CFArrayRef display_modes = CGDisplayCopyAllDisplayModes(id, nullptr);
+	for (CFIndex i = 0, count = CFArrayGetCount(display_modes); i < count; ++i)
+	{
+		CGDisplayModeRef display_mode = (CGDisplayModeRef)CFArrayGetValueAtIndex(display_modes, i);
+		display::mode const candidate = make_mode(display_mode);
+		if (candidate.width == m.width && candidate.height == m.height && candidate.bpp == m.bpp
+			&& (m.frequency? candidate.frequency == m.frequency : (!best || candidate.frequency > frequency)))
+		{
+			best = display_mode;
+			frequency = candidate.frequency;
+		}
+	}
+
+	bool const result = best && CGDisplaySetDisplayMode(id, best, nullptr) == kCGErrorSuccess;
+	CFRelease(display_modes);
+	return result;
+}
+
+void display::restore_mode() const
+{
+	CGRestorePermanentDisplayConfiguration();
+}
+
 }} // aspect::gui
@@ -122,4 +122,34 @@ display::mode display::current_mode() const
 			devmode.dmBitsPerPel, devmode.dmDisplayFrequency);
 }
 
+bool display::set_mode(mode const& m) const
+{
+	// Find matching mode, with the highest refresh rate for zero frequency
+	DEVMODE devmode, best;
+	devmode.dmSize = sizeof(devmode);
+	best.dmDisplayFrequency = 0;
+	bool found = false;
+	for (int i = 0; EnumDisplaySettingsW(name.c_str(), i, &devmode); ++i)
+	{
+		if (devmode.dmPelsWidth == m.width && devmode.dmPelsHeight == m.height && devmode.dmBitsPerPel == m.bpp
+			&& (m.frequency? devmode.dmDisplayFrequency == m.frequency : (!found || devmode.dmDisplayFrequency > best.dmDisplayFrequency)))
+		{
+			best = devmode;
+			found = true;
+		}
+	}
+	if (!found)
+	{
+		return false;
+	}
+
+	best.dmFields = DM_PELSWIDTH | DM_PELSHEIGHT | DM_BITSPERPEL | DM_DISPLAYFREQUENCY;
+	return ChangeDisplaySettingsExW(name.c_str(), &best, NULL, CDS_FULLSCREEN, NULL) == DISP_CHANGE_SUCCESSFUL;
+}
+
+void display::restore_mode() const
+{
+	ChangeDisplaySettingsExW(name.c_str(), NULL, NULL, 0, NULL);
+}
+
 }} // aspect::gui
@@ -1,96 +1,170 @@
 #include "oxygen/oxygen.hpp"
 #include "oxygen/display.hpp"
 
+#include <X11/Xlib-xcb.h>
+#include <xcb/randr.h>
+
 namespace aspect {  namespace gui {
 
-XRRModeInfo const* mode_info(XRRScreenResources const* sr, RRMode id)
+// RandR queries are made with XCB on the g_display connection: independent
+// requests are sent at once and their replies are collected afterwards,
+// so a query costs a round trip per dependency level, not per request.
+
+struct free_reply
+{
+	void operator()(void* reply) const { free(reply); }
+};
+
+typedef std::unique_ptr<xcb_randr_get_screen_resources_current_reply_t, free_reply> screen_resources_ptr;
+typedef std::unique_ptr<xcb_randr_get_crtc_info_reply_t, free_reply> crtc_info_ptr;
+typedef std::unique_ptr<xcb_randr_get_output_info_reply_t, free_reply> output_info_ptr;
+
+static xcb_connection_t* connection()
+{
+	return XGetXCBConnection(g_display);
+}
+
+static bool is_rotated(uint16_t rotation)
+{
+	return (rotation & (XCB_RANDR_ROTATION_ROTATE_90 | XCB_RANDR_ROTATION_ROTATE_270)) != 0;
+}
+
+// Screen resources and primary output, requested together
+static screen_resources_ptr get_screen_resources(xcb_connection_t* c, RROutput* primary = nullptr)
+{
+	xcb_randr_get_screen_resources_current_cookie_t const sr_cookie = xcb_randr_get_screen_resources_current(c, g_root);
+	if (primary)
+	{
+		xcb_randr_get_output_primary_cookie_t const primary_cookie = xcb_randr_get_output_primary(c, g_root);
+		xcb_randr_get_output_primary_reply_t* primary_reply = xcb_randr_get_output_primary_reply(c, primary_cookie, nullptr);
+		*primary = primary_reply? primary_reply->output : None;
+		free(primary_reply);
+	}
+	return screen_resources_ptr(xcb_randr_get_screen_resources_current_reply(c, sr_cookie, nullptr));
+}
+
+static xcb_randr_mode_info_t const* mode_info(xcb_randr_get_screen_resources_current_reply_t const* sr, xcb_randr_mode_t id)
 {
-	XRRModeInfo const* result = std::find_if(sr->modes, sr->modes + sr->nmode,
-			[id](XRRModeInfo const& info) { return info.id == id; });
-	return (result == sr->modes + sr->nmode)? nullptr : result;
+	xcb_randr_mode_info_t const* modes = xcb_randr_get_screen_resources_current_modes(sr);
+	xcb_randr_mode_info_t const* modes_end = modes + xcb_randr_get_screen_resources_current_modes_length(sr);
+	xcb_randr_mode_info_t const* result = std::find_if(modes, modes_end,
+		[id](xcb_randr_mode_info_t const& info) { return info.id == id; });
+	return (result == modes_end)? nullptr : result;
 }
 
-static display init(XRRScreenResources* sr, RROutput output)
+static display init(RROutput output, xcb_randr_get_output_info_reply_t const* oi, xcb_randr_get_crtc_info_reply_t const* ci)
 {
 	display result;
 
-	XRROutputInfo* oi = XRRGetOutputInfo(g_display, sr, output);
-	if (oi->connection == RR_Connected)
+	if (oi && ci && oi->connection == XCB_RANDR_CONNECTION_CONNECTED)
 	{
 		result.scale = 1;
-		result.name = oi->name;
+		result.name.assign(reinterpret_cast<char const*>(xcb_randr_get_output_info_name(oi)),
+			xcb_randr_get_output_info_name_length(oi));
 		result.color_depth = XDefaultDepth(g_display, g_screen);
 		result.color_depth_per_component = result.color_depth >= 24? 8 : 0;
 
 		result.crtc = oi->crtc;
 		result.output = output;
 
-		XRRCrtcInfo* ci = XRRGetCrtcInfo(g_display, sr, oi->crtc);
 		result.rect.left = ci->x;
 		result.rect.top = ci->y;
 		result.rect.width = ci->width;
 		result.rect.height = ci->height;
-		if (ci->rotation == RR_Rotate_90 || ci->rotation == RR_Rotate_270)
+		if (is_rotated(ci->rotation))
 		{
 			std::swap(result.rect.width, result.rect.height);
 		}
-		XRRFreeCrtcInfo(ci);
 
 		result.work_rect = result.rect;
 	}
-	XRRFreeOutputInfo(oi);
 	return result;
 }
 
-static display::mode make_mode(XRRModeInfo const* mi, XRRCrtcInfo const* ci)
+static display::mode make_mode(xcb_randr_mode_info_t const* mi, xcb_randr_get_crtc_info_reply_t const* ci)
 {
 	unsigned width = mi->width;
 	unsigned height = mi->height;
 	unsigned bpp = DefaultDepth(g_display, g_screen);
 	unsigned frequency = 0;
-	if (ci->rotation == RR_Rotate_90 || ci->rotation == RR_Rotate_270)
+	if (is_rotated(ci->rotation))
 	{
 		std::swap(width, height);
 	}
-	if (mi->hTotal && mi->vTotal)
+	if (mi->htotal && mi->vtotal)
 	{
-		double const s = mi->hTotal * mi->vTotal;
-		frequency = static_cast<unsigned>(mi->dotClock / s);
+		double const s = mi->htotal * mi->vtotal;
+		frequency = static_cast<unsigned>(mi->dot_clock / s);
 	}
 	return display::mode(width, height, bpp, frequency);
 }
 
 std::vector<display> display::enumerate()
 {
+	display_lock lock(g_display, g_display_lock_stats);
+
 	std::vector<display> result;
 
 	if (randr.is_available)
 	{
-		RROutput const primary = XRRGetOutputPrimary(g_display, g_root);
+		xcb_connection_t* c = connection();
+
+		RROutput primary;
+		screen_resources_ptr const sr = get_screen_resources(c, &primary);
+		if (!sr)
+		{
+			return result;
+		}
+
+		xcb_randr_crtc_t const* crtcs = xcb_randr_get_screen_resources_current_crtcs(sr.get());
+		int const crtc_count = xcb_randr_get_screen_resources_current_crtcs_length(sr.get());
+		xcb_randr_output_t const* outputs = xcb_randr_get_screen_resources_current_outputs(sr.get());
+		int const output_count = xcb_randr_get_screen_resources_current_outputs_length(sr.get());
 
-		XRRScreenResources* sr = XRRGetScreenResources(g_display, g_root);
-		for (int i = 0; i < sr->ncrtc; ++i)
+		// Request all CRTC and output infos in one pass
+		std::vector<xcb_randr_get_crtc_info_cookie_t> crtc_cookies(crtc_count);
+		for (int i = 0; i < crtc_count; ++i)
 		{
-			XRRCrtcInfo* info = XRRGetCrtcInfo(g_display, sr, sr->crtcs[i]);
+			crtc_cookies[i] = xcb_randr_get_crtc_info(c, crtcs[i], sr->config_timestamp);
+		}
+		std::vector<xcb_randr_get_output_info_cookie_t> output_cookies(output_count);
+		for (int i = 0; i < output_count; ++i)
+		{
+			output_cookies[i] = xcb_randr_get_output_info(c, outputs[i], sr->config_timestamp);
+		}
 
-			if (info->noutput)
+		std::vector<output_info_ptr> output_infos(output_count);
+		for (int i = 0; i < output_count; ++i)
+		{
+			output_infos[i].reset(xcb_randr_get_output_info_reply(c, output_cookies[i], nullptr));
+		}
+
+		for (int i = 0; i < crtc_count; ++i)
+		{
+			crtc_info_ptr const info(xcb_randr_get_crtc_info_reply(c, crtc_cookies[i], nullptr));
+			if (!info || !info->num_outputs)
 			{
-				RROutput* output = std::find_if(info->outputs, info->outputs + info->noutput,
-					[primary](RROutput output) { return output == primary; });
-				if (output == info->outputs + info->noutput)
-				{
-					output = info->outputs;
-				}
+				continue;
+			}
 
-				display disp = init(sr, *output);
+			xcb_randr_output_t const* crtc_outputs = xcb_randr_get_crtc_info_outputs(info.get());
+			xcb_randr_output_t const* crtc_outputs_end = crtc_outputs + info->num_outputs;
+			xcb_randr_output_t const* output = std::find(crtc_outputs, crtc_outputs_end, primary);
+			if (output == crtc_outputs_end)
+			{
+				output = crtc_outputs;
+			}
+
+			int const output_index = static_cast<int>(std::find(outputs, outputs + output_count, *output) - outputs);
+			if (output_index < output_count)
+			{
+				display disp = init(*output, output_infos[output_index].get(), info.get());
 				if (!disp.name.empty())
 				{
 					result.emplace_back(disp);
 				}
 			}
-			XRRFreeCrtcInfo(info);
 		}
-		XRRFreeScreenResources(sr);
 
 		std::vector<display>::iterator it = std::find_if(result.begin(), result.end(),
 			[primary](display const& disp) { return disp.output == primary; });
@@ -107,24 +181,61 @@ std::vector<display> display::enumerate()
 	return result;
 }
 
-display display::primary()
+display display::from_window(window const* w)
 {
-	return from_window(nullptr);
+	return w? from_rect(w->rect()) : primary();
 }
 
-display display::from_window(window const* w)
+display display::from_rect(rectangle<int> const& rect)
 {
-	Window root = w? *w : g_root;
+	std::vector<display> const displays = enumerate();
+
+	// Squared distance between rectangles for the nearest display, negative intersection area otherwise
+	auto const score = [&rect](display const& disp)
+	{
+		int64_t const dx = std::max(disp.rect.left, rect.left)
+			- std::min(disp.rect.left + disp.rect.width, rect.left + rect.width);
+		int64_t const dy = std::max(disp.rect.top, rect.top)
+			- std::min(disp.rect.top + disp.rect.height, rect.top + rect.height);
+		if (dx < 0 && dy < 0)
+		{
+			return -dx * dy;
+		}
+		return std::max(dx, int64_t(0)) * std::max(dx, int64_t(0)) + std::max(dy, int64_t(0)) * std::max(dy, int64_t(0));
+	};
+
+	auto const it = std::min_element(displays.begin(), displays.end(),
+		[&score](display const& lhs, display const& rhs) { return score(lhs) < score(rhs); });
+	return it != displays.end()? *it : primary();
+}
+
+display display::primary()
+{
+	display_lock lock(g_display, g_display_lock_stats);
+
 	display result;
 	if (randr.is_available)
 	{
-		XRRScreenResources* sr = XRRGetScreenResources(g_display, root);
-		RROutput primary = XRRGetOutputPrimary(g_display, g_root);
-		result = init(sr, primary);
-		XRRFreeScreenResources(sr);
+		xcb_connection_t* c = connection();
+
+		RROutput primary;
+		screen_resources_ptr const sr = get_screen_resources(c, &primary);
+		if (sr)
+		{
+			output_info_ptr const oi(xcb_randr_get_output_info_reply(c,
+				xcb_randr_get_output_info(c, primary, sr->config_timestamp), nullptr));
+			if (oi)
+			{
+				crtc_info_ptr const ci(xcb_randr_get_crtc_info_reply(c,
+					xcb_randr_get_crtc_info(c, oi->crtc, sr->config_timestamp), nullptr));
+				result = init(primary, oi.get(), ci.get());
+			}
+		}
 	}
 	else
 	{
+		result.crtc = None;
+		result.output = None;
 		result.scale = 1;
 		result.color_depth = XDefaultDepth(g_display, g_screen);
 		result.color_depth_per_component = result.color_depth >= 24? 8 : 0;
@@ -136,26 +247,37 @@ display display::from_window(window const* w)
 
 std::vector<display::mode> display::modes() const
 {
+	display_lock lock(g_display, g_display_lock_stats);
+
 	std::vector<display::mode> result;
 	if (randr.is_available)
 	{
-		XRRScreenResources* sr = XRRGetScreenResources(g_display, g_root);
-		XRRCrtcInfo* ci = XRRGetCrtcInfo(g_display, sr, crtc);
-		XRROutputInfo* oi = XRRGetOutputInfo(g_display, sr, output);
+		xcb_connection_t* c = connection();
+
+		screen_resources_ptr const sr = get_screen_resources(c);
+		if (!sr)
+		{
+			return result;
+		}
 
-		for (int i = 0; i < oi->nmode; ++i)
+		xcb_randr_get_crtc_info_cookie_t const crtc_cookie = xcb_randr_get_crtc_info(c, crtc, sr->config_timestamp);
+		xcb_randr_get_output_info_cookie_t const output_cookie = xcb_randr_get_output_info(c, output, sr->config_timestamp);
+		crtc_info_ptr const ci(xcb_randr_get_crtc_info_reply(c, crtc_cookie, nullptr));
+		output_info_ptr const oi(xcb_randr_get_output_info_reply(c, output_cookie, nullptr));
+
+		if (ci && oi)
 		{
-			XRRModeInfo const* mi = mode_info(sr, oi->modes[i]);
-			if (mi && !(mi->modeFlags & RR_Interlace))
+			xcb_randr_mode_t const* modes = xcb_randr_get_output_info_modes(oi.get());
+			for (int i = 0, count = xcb_randr_get_output_info_modes_length(oi.get()); i < count; ++i)
 			{
-				result.emplace_back(make_mode(mi, ci));
+				xcb_randr_mode_info_t const* mi = mode_info(sr.get(), modes[i]);
+				if (mi && !(mi->mode_flags & XCB_RANDR_MODE_FLAG_INTERLACE))
+				{
+					result.emplace_back(make_mode(mi, ci.get()));
+				}
 			}
 		}
 
-		XRRFreeOutputInfo(oi);
-		XRRFreeCrtcInfo(ci);
-		XRRFreeScreenResources(sr);
-
 		std::sort(result.begin(), result.end());
 		result.erase(std::unique(result.begin(), result.end()), result.end());
 	}
@@ -166,26 +288,137 @@ std::vector<display::mode> display::modes() const
 	return result;
 }
 
-display::mode display::current_mode() const
+// CRTC configurations before set_mode(), accessed under g_display lock
+struct crtc_config
 {
-	if (randr.is_available)
+	int16_t x, y;
+	xcb_randr_mode_t mode;
+	uint16_t rotation;
+	std::vector<xcb_randr_output_t> outputs;
+};
+
+static std::map<RRCrtc, crtc_config> saved_crtc_configs;
+
+static bool set_crtc_config(xcb_connection_t* c, xcb_randr_get_screen_resources_current_reply_t const* sr,
+	RRCrtc crtc, crtc_config const& config)
+{
+	xcb_randr_set_crtc_config_reply_t* reply = xcb_randr_set_crtc_config_reply(c,
+		xcb_randr_set_crtc_config(c, crtc, sr->timestamp, sr->config_timestamp, config.x, config.y,
+			config.mode, config.rotation, static_cast<uint32_t>(config.outputs.size()), config.outputs.data()),
+		nullptr);
+	bool const result = reply && reply->status == XCB_RANDR_SET_CONFIG_SUCCESS;
+	free(reply);
+	return result;
+}
+
+bool display::set_mode(mode const& m) const
+{
+	display_lock lock(g_display, g_display_lock_stats);
+
+	if (!randr.is_available)
 	{
-		XRRScreenResources* sr = XRRGetScreenResources(g_display, g_root);
-		XRRCrtcInfo* ci =  XRRGetCrtcInfo(g_display, sr, crtc);
+		return false;
+	}
 
-		XRRModeInfo const* mi = mode_info(sr, ci->mode);
-		display::mode const result = make_mode(mi, ci);
+	xcb_connection_t* c = connection();
 
-		XRRFreeCrtcInfo(ci);
-		XRRFreeScreenResources(sr);
+	screen_resources_ptr const sr = get_screen_resources(c);
+	if (!sr)
+	{
+		return false;
+	}
 
-		return result;
+	xcb_randr_get_crtc_info_cookie_t const crtc_cookie = xcb_randr_get_crtc_info(c, crtc, sr->config_timestamp);
+	xcb_randr_get_output_info_cookie_t const output_cookie = xcb_randr_get_output_info(c, output, sr->config_timestamp);
+	crtc_info_ptr const ci(xcb_randr_get_crtc_info_reply(c, crtc_cookie, nullptr));
+	output_info_ptr const oi(xcb_randr_get_output_info_reply(c, output_cookie, nullptr));
+	if (!ci || !oi)
+	{
+		return false;
 	}
-	else
+
+	// Match the mode the same way as in modes(), with the highest refresh rate for zero frequency
+	xcb_randr_mode_t mode_id = 0;
+	unsigned frequency = 0;
+	xcb_randr_mode_t const* modes = xcb_randr_get_output_info_modes(oi.get());
+	for (int i = 0, count = xcb_randr_get_output_info_modes_length(oi.get()); i < count; ++i)
 	{
-		return display::mode(DisplayWidth(g_display, g_screen), DisplayHeight(g_display, g_screen),
-			DefaultDepth(g_display, g_screen), 0);
+		xcb_randr_mode_info_t const* mi = mode_info(sr.get(), modes[i]);
+		if (!mi || (mi->mode_flags & XCB_RANDR_MODE_FLAG_INTERLACE))
+		{
+			continue;
+		}
+		display::mode const candidate = make_mode(mi, ci.get());
+		if (candidate.width == m.width && candidate.height == m.height && candidate.bpp == m.bpp
+			&& (m.frequency? candidate.frequency == m.frequency : (!mode_id || candidate.frequency > frequency)))
+		{
+			mode_id = mi->id;
+			frequency = candidate.frequency;
+		}
 	}
+	if (!mode_id)
+	{
+		return false;
+	}
+	if (mode_id == ci->mode)
+	{
+		return true;
+	}
+
+	crtc_config config;
+	config.x = ci->x;
+	config.y = ci->y;
+	config.mode = ci->mode;
+	config.rotation = ci->rotation;
+	config.outputs.assign(xcb_randr_get_crtc_info_outputs(ci.get()),
+		xcb_randr_get_crtc_info_outputs(ci.get()) + ci->num_outputs);
+
+	// Keep the first configuration to restore
+	saved_crtc_configs.insert(std::make_pair(crtc, config));
+
+	config.mode = mode_id;
+	return set_crtc_config(c, sr.get(), crtc, config);
+}
+
+void display::restore_mode() const
+{
+	display_lock lock(g_display, g_display_lock_stats);
+
+	auto const it = saved_crtc_configs.find(crtc);
+	if (it == saved_crtc_configs.end())
+	{
+		return;
+	}
+
+	xcb_connection_t* c = connection();
+	screen_resources_ptr const sr = get_screen_resources(c);
+	if (sr)
+	{
+		set_crtc_config(c, sr.get(), crtc, it->second);
+	}
+	saved_crtc_configs.erase(it);
+}
+
+display::mode display::current_mode() const
+{
+	display_lock lock(g_display, g_display_lock_stats);
+
+	if (randr.is_available)
+	{
+		xcb_connection_t* c = connection();
+
+		screen_resources_ptr const sr = get_screen_resources(c);
+		crtc_info_ptr const ci(sr? xcb_randr_get_crtc_info_reply(c,
+			xcb_randr_get_crtc_info(c, crtc, sr->config_timestamp), nullptr) : nullptr);
+		xcb_randr_mode_info_t const* mi = ci? mode_info(sr.get(), ci->mode) : nullptr;
+		if (mi)
+		{
+			return make_mode(mi, ci.get());
+		}
+	}
+
+	return display::mode(DisplayWidth(g_display, g_screen), DisplayHeight(g_display, g_screen),
+		DefaultDepth(g_display, g_screen), 0);
 }
 
 }} // aspect::gui
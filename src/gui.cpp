@@ -1,6 +1,12 @@
 #include "oxygen/oxygen.hpp"
+#include "oxygen/recorder.hpp"
+
+#include <iostream>
+#include <limits>
+#include <numeric>
 
 #include <boost/algorithm/cxx11/any_of.hpp>
+#include <boost/make_shared.hpp>
 
 namespace aspect {  namespace gui {
 
@@ -16,15 +22,27 @@ creation_args::creation_args(v8::FunctionCallbackInfo<v8::Value> const& args)
 		throw std::runtime_error("Window constructor requires configuration object as an argument");
 	}
 
-	display disp = display::primary();
-	get_option(isolate, options, "display", disp);
-	display::mode const& curr_mode = disp.current_mode();
+	bool const has_width = get_option(isolate, options, "width", width);
+	bool const has_height = get_option(isolate, options, "height", height);
+	bool const has_left = get_option(isolate, options, "left", left);
+	bool const has_top = get_option(isolate, options, "top", top);
+	bool const has_bpp = get_option(isolate, options, "bpp", bpp);
+	bool const has_display = get_option(isolate, options, "display", disp);
+
+	// Query display mode only for missing options, it takes server round trips
+	if (!has_width || !has_height || !has_left || !has_top || !has_bpp)
+	{
+		display const target = has_display? disp : display::primary();
+		display::mode const curr_mode = target.current_mode();
 
-	get_option(isolate, options, "width", width = curr_mode.width);
-	get_option(isolate, options, "height", height = curr_mode.height);
-	get_option(isolate, options, "left", left = max(int(curr_mode.width - width) / 2, 0));
-	get_option(isolate, options, "top", top = max(int(curr_mode.height - height) / 2, 0));
-	get_option(isolate, options, "bpp", bpp = curr_mode.bpp);
+		if (!has_width) width = curr_mode.width;
+		if (!has_height) height = curr_mode.height;
+		if (!has_left) left = target.rect.left + max(int(curr_mode.width - width) / 2, 0);
+		if (!has_top) top = target.rect.top + max(int(curr_mode.height - height) / 2, 0);
+		if (!has_bpp) bpp = curr_mode.bpp;
+	}
+	get_option(isolate, options, "frequency", frequency = 0);
+	get_option(isolate, options, "reuseEvents", reuse_events = false);
 	get_option(isolate, options, "style", style = GWS_TITLEBAR | GWS_RESIZE | GWS_CLOSE | GWS_APPWINDOW);
 	get_option(isolate, options, "caption", caption);
 	get_option(isolate, options, "splash", splash);
@@ -34,9 +52,92 @@ creation_args::creation_args(v8::FunctionCallbackInfo<v8::Value> const& args)
 static char const* const types[] =
 {
 	"unknown", "keydown", "keyup", "char",
-	"mousemove", "mousewheel", "mousedown", "mouseup", "mouseclick",
+	"mousemove", "mousewheel", "mousedown", "mouseup", "mouseclick", "dragstart",
+	"regionenter", "regionleave",
 };
 static size_t const type_count = sizeof types / sizeof(*types);
+static_assert(type_count == input_event::EVENT_TYPE_COUNT, "input event type names mismatch");
+
+static char const* const window_events[] =
+{
+	"resize", "close", "move", "frame",
+};
+static size_t const window_event_count = sizeof window_events / sizeof(*window_events);
+static_assert(window_event_count == window_base::LISTENER_TABLE_SIZE - window_base::RESIZE_EVENT,
+	"window event names mismatch");
+static_assert(window_base::LISTENER_TABLE_SIZE <= 32, "listener mask too small");
+
+// String caches by isolate, the map is changed on install and uninstall only
+static std::map<v8::Isolate*, string_cache*> string_caches;
+static boost::mutex string_caches_mutex;
+
+string_cache& string_cache::instance(v8::Isolate* isolate)
+{
+	boost::mutex::scoped_lock lock(string_caches_mutex);
+
+	string_cache*& cache = string_caches[isolate];
+	if (!cache)
+	{
+		cache = new string_cache(isolate);
+	}
+	return *cache;
+}
+
+void string_cache::clear(v8::Isolate* isolate)
+{
+	boost::mutex::scoped_lock lock(string_caches_mutex);
+
+	std::map<v8::Isolate*, string_cache*>::iterator const it = string_caches.find(isolate);
+	if (it != string_caches.end())
+	{
+		delete it->second;
+		string_caches.erase(it);
+	}
+}
+
+v8::Local<v8::String> string_cache::get(char const* str)
+{
+	v8::Eternal<v8::String>& entry = strings_[str];
+	if (entry.IsEmpty())
+	{
+		entry.Set(isolate_, v8::String::NewFromUtf8(isolate_, str, v8::String::kInternalizedString));
+	}
+	return entry.Get(isolate_);
+}
+
+input_event input_event::mouse(event_type type, uint32_t button, uint32_t modifiers,
+	int x, int y, int dx, int dy)
+{
+	_aspect_assert(type >= MOUSE_MOVE && type <= MOUSE_REGION_LEAVE && "mouse event type expected");
+
+	input_event result;
+	result.type_and_state_ = ((type << TYPE_SHIFT) & TYPE_MASK)
+		| ((button << BUTTON_SHIFT) & BUTTON_MASK)
+		| ((modifiers << STATE_SHIFT) & STATE_MASK);
+	result.data_.mouse.x = x;
+	result.data_.mouse.y = y;
+	result.data_.mouse.dx = dx;
+	result.data_.mouse.dy = dy;
+	result.repeats_ = (type == MOUSE_DOWN || type == MOUSE_UP)? 1 : 0;
+	return result;
+}
+
+input_event input_event::key(event_type type, uint32_t modifiers,
+	uint32_t vk_code, uint32_t scan_code, uint32_t char_code)
+{
+	_aspect_assert(type >= KEY_DOWN && type <= KEY_CHAR && "key event type expected");
+
+	input_event result;
+	result.type_and_state_ = ((type << TYPE_SHIFT) & TYPE_MASK)
+		| ((modifiers << STATE_SHIFT) & STATE_MASK);
+	result.data_.key.vk_code = vk_code;
+	result.data_.key.scan_code = scan_code;
+	result.data_.key.key_code = vk_code;
+	result.data_.key.char_code = char_code;
+	result.data_.key.code = 0;
+	result.repeats_ = (type == KEY_DOWN)? 1 : 0;
+	return result;
+}
 
 std::string input_event::type_to_str(event_type type)
 {
@@ -56,58 +157,169 @@ input_event::event_type input_event::type_from_str(std::string const& str)
 	return UNKNOWN;
 }
 
+void input_event::pack(uint32_t* data) const
+{
+	data[0] = type_and_state_;
+	data[1] = repeats_;
+	if (is_key())
+	{
+		data[2] = data_.key.vk_code;
+		data[3] = data_.key.scan_code;
+		data[4] = data_.key.key_code;
+		data[5] = data_.key.char_code;
+		data[6] = data_.key.code;
+	}
+	else
+	{
+		data[2] = data_.mouse.x;
+		data[3] = data_.mouse.y;
+		data[4] = data_.mouse.dx;
+		data[5] = data_.mouse.dy;
+		data[6] = region_;
+	}
+}
+
+input_event input_event::unpack(uint32_t const* data)
+{
+	input_event result;
+	result.type_and_state_ = data[0];
+	result.repeats_ = data[1];
+	if (result.is_key())
+	{
+		result.data_.key.vk_code = data[2];
+		result.data_.key.scan_code = data[3];
+		result.data_.key.key_code = data[4];
+		result.data_.key.char_code = data[5];
+		result.data_.key.code = data[6];
+	}
+	else
+	{
+		result.data_.mouse.x = data[2];
+		result.data_.mouse.y = data[3];
+		result.data_.mouse.dx = data[4];
+		result.data_.mouse.dy = data[5];
+		result.region_ = data[6];
+	}
+	return result;
+}
+
+// Set a property with the cached name, numbers and booleans don't allocate on the V8 heap
+template<typename T>
+static void set_property(v8::Isolate* isolate, string_cache& names, v8::Handle<v8::Object> object,
+	char const* name, T const& value)
+{
+	object->Set(names.get(name), v8pp::to_v8(isolate, value));
+}
+
+// Single character strings for cached key event chars, empty one for 0
+struct ascii_strings
+{
+	char str[128][2];
+
+	ascii_strings()
+	{
+		for (int i = 0; i < 128; ++i)
+		{
+			str[i][0] = static_cast<char>(i);
+			str[i][1] = 0;
+		}
+	}
+};
+static ascii_strings const ascii;
+
 v8::Handle<v8::Value> input_event::to_v8(v8::Isolate* isolate) const
+{
+	return to_v8(isolate, string_cache::instance(isolate));
+}
+
+v8::Handle<v8::Value> input_event::to_v8(v8::Isolate* isolate, string_cache& names) const
 {
 	v8::EscapableHandleScope scope(isolate);
 
 	v8::Local<v8::Object> object = v8::Object::New(isolate);
-	set_option(isolate, object, "type", type_str());
+	object->Set(names.get("type"), names.get(type() < type_count? types[type()] : types[UNKNOWN]));
+	to_v8(isolate, object, names);
+	return scope.Escape(object);
+}
+
+void input_event::to_v8(v8::Isolate* isolate, v8::Handle<v8::Object> object) const
+{
+	to_v8(isolate, object, string_cache::instance(isolate));
+}
+
+void input_event::to_v8(v8::Isolate* isolate, v8::Handle<v8::Object> object, string_cache& names) const
+{
+	v8::HandleScope scope(isolate);
 
 	if (type() != UNKNOWN)
 	{
-		v8::Local<v8::Object> modifiers = v8::Object::New(isolate);
-		set_option(isolate, object, "modifiers", modifiers);
+		// Property names are internalized once per isolate
+		v8::Local<v8::Value> const modifiers_value = object->Get(names.get("modifiers"));
+		v8::Local<v8::Object> modifiers;
+		if (modifiers_value->IsObject())
+		{
+			modifiers = modifiers_value.As<v8::Object>();
+		}
+		else
+		{
+			modifiers = v8::Object::New(isolate);
+			object->Set(names.get("modifiers"), modifiers);
+		}
 
-		set_option(isolate, modifiers, "ctrl",     ctrl());
-		set_option(isolate, modifiers, "alt",      alt());
-		set_option(isolate, modifiers, "shift",    shift());
-		set_option(isolate, modifiers, "lbutton",  lbutton());
-		set_option(isolate, modifiers, "mbutton",  mbutton());
-		set_option(isolate, modifiers, "rbutton",  rbutton());
-		set_option(isolate, modifiers, "xbutton1", xbutton1());
-		set_option(isolate, modifiers, "xbutton2", xbutton2());
+		set_property(isolate, names, modifiers, "ctrl",     ctrl());
+		set_property(isolate, names, modifiers, "alt",      alt());
+		set_property(isolate, names, modifiers, "shift",    shift());
+		set_property(isolate, names, modifiers, "lbutton",  lbutton());
+		set_property(isolate, names, modifiers, "mbutton",  mbutton());
+		set_property(isolate, names, modifiers, "rbutton",  rbutton());
+		set_property(isolate, names, modifiers, "xbutton1", xbutton1());
+		set_property(isolate, names, modifiers, "xbutton2", xbutton2());
 
-		set_option(isolate, object, "repeats",  repeats());
+		set_property(isolate, names, object, "repeats",  repeats());
 
 		if (is_key())
 		{
-			set_option(isolate, object, "vk_code",  vk_code());
-			set_option(isolate, object, "scan_code", scan_code());
-			set_option(isolate, object, "key_code", key_code());
+			set_property(isolate, names, object, "vk_code",  vk_code());
+			set_property(isolate, names, object, "scan_code", scan_code());
+			set_property(isolate, names, object, "key_code", key_code());
+			set_property(isolate, names, object, "code", code());
 
 			uint32_t const ch = character();
 #if OS(WINDOWS)
-			set_option(isolate, object, "char", std::wstring(ch? 1 : 0, static_cast<wchar_t>(ch)));
+			set_property(isolate, names, object, "char", std::wstring(ch? 1 : 0, static_cast<wchar_t>(ch)));
 #else
-			std::string str;
-			if (ch) utils::to_utf8(&ch, &ch + 1, std::back_inserter(str));
-			set_option(isolate, object, "char", str);
+			if (ch < 128)
+			{
+				object->Set(names.get("char"), names.get(ascii.str[ch]));
+			}
+			else
+			{
+				std::string str;
+				utils::to_utf8(&ch, &ch + 1, std::back_inserter(str));
+				set_property(isolate, names, object, "char", str);
+			}
 #if !OS(DARWIN)
-			char const* const keysym = XKeysymToString(vk_code());
-			set_option(isolate, object, "key_sym", keysym? keysym : "");
+			object->Set(names.get("key_sym"), keysym_string(isolate, names, scan_code(), vk_code()));
 #endif
 #endif
 		}
 		else if (is_mouse())
 		{
-			if (button()) set_option(isolate, object, "button", button());
-			set_option(isolate, object, "x",  x());
-			set_option(isolate, object, "y",  y());
-			set_option(isolate, object, "dx", dx());
-			set_option(isolate, object, "dy", dy());
+			// a reused object has to overwrite the button of a previous event
+			if (button() || object->Has(names.get("button")))
+			{
+				set_property(isolate, names, object, "button", button());
+			}
+			set_property(isolate, names, object, "x",  x());
+			set_property(isolate, names, object, "y",  y());
+			set_property(isolate, names, object, "dx", dx());
+			set_property(isolate, names, object, "dy", dy());
+			if (region() || object->Has(names.get("region")))
+			{
+				set_property(isolate, names, object, "region", region());
+			}
 		}
 	}
-	return scope.Escape(object);
 }
 
 input_event input_event::from_v8(v8::Isolate* isolate, v8::Handle<v8::Value> value)
@@ -162,6 +374,7 @@ input_event input_event::from_v8(v8::Isolate* isolate, v8::Handle<v8::Value> val
 		get_option(isolate, object, "vk_code",  result.data_.key.vk_code = 0);
 		get_option(isolate, object, "scan_code", result.data_.key.scan_code = 0);
 		get_option(isolate, object, "key_code",  result.data_.key.key_code = 0);
+		get_option(isolate, object, "code",  result.data_.key.code = 0);
 		result.data_.key.char_code = 0;
 #if OS(WINDOWS)
 		std::wstring str;
@@ -191,65 +404,1242 @@ input_event input_event::from_v8(v8::Isolate* isolate, v8::Handle<v8::Value> val
 	return result;
 }
 
-void window_base::on_resize(box<int> const& new_size)
+// Create a zero filled typed array over native memory. The array buffer is externalized,
+// so JavaScript can neither detach nor transfer it and the memory never moves
+template<typename Array, typename T>
+static T* create_shared_array(v8::Isolate* isolate, v8::Persistent<Array>& array, size_t length)
 {
-	std::for_each(event_sinks_.begin(), event_sinks_.end(),
-		[&new_size](event_sink* sink) { sink->on_resize(new_size); });
+	v8::HandleScope scope(isolate);
+
+	T* const data = new T[length]();
+	v8::Local<v8::ArrayBuffer> buffer = v8::ArrayBuffer::New(isolate, data, length * sizeof(T),
+		v8::ArrayBufferCreationMode::kExternalized);
+	array.Reset(isolate, Array::New(buffer, 0, length));
+	return data;
+}
+
+// Memory of a released shared array, freed when its array buffer is collected
+template<typename T>
+struct shared_array_memory
+{
+	v8::Persistent<v8::ArrayBuffer> buffer;
+	T* data;
 
-	if (has("resize"))
+	static void free(v8::WeakCallbackInfo<shared_array_memory> const& info)
 	{
-		rt_.main_loop().schedule(boost::bind(&window_base::on_resize_v8, this, new_size));
+		shared_array_memory* memory = info.GetParameter();
+		memory->buffer.Reset();
+		delete[] memory->data;
+		delete memory;
 	}
+};
+
+// Drop the native reference to a shared array, JavaScript may still use it
+template<typename Array, typename T>
+static void release_shared_array(v8::Isolate* isolate, v8::Persistent<Array>& array, T* data)
+{
+	v8::HandleScope scope(isolate);
+
+	shared_array_memory<T>* memory = new shared_array_memory<T>;
+	memory->buffer.Reset(isolate, v8::Local<Array>::New(isolate, array)->Buffer());
+	memory->buffer.SetWeak(memory, &shared_array_memory<T>::free, v8::WeakCallbackType::kParameter);
+	memory->data = data;
+	array.Reset();
 }
 
-void window_base::on_screen_change()
+static boost::atomic<uint32_t> window_ids(0);
+
+// Active recorder, checked without the lock for each event
+static boost::atomic<event_recorder*> recorder(nullptr);
+static boost::mutex recorder_mutex;
+
+static void record_event(event_record& record)
 {
-	std::for_each(event_sinks_.begin(), event_sinks_.end(),
-		[](event_sink* sink) { sink->on_screen_change(); });
+	if (recorder.load(boost::memory_order_acquire))
+	{
+		boost::mutex::scoped_lock lock(recorder_mutex);
+		if (event_recorder* rec = recorder.load(boost::memory_order_relaxed))
+		{
+			rec->append(record);
+		}
+	}
 }
 
-void window_base::on_input(input_event const& inp_e)
+void window_base::start_recording(std::string const& filename)
 {
-	if (inp_e.type() != input_event::UNKNOWN)
+	std::unique_ptr<event_recorder> rec(new event_recorder(filename));
+
+	boost::mutex::scoped_lock lock(recorder_mutex);
+	if (recorder)
 	{
-		std::for_each(event_sinks_.begin(), event_sinks_.end(),
-			[&inp_e](event_sink* sink) { sink->on_input(inp_e); });
+		throw std::runtime_error("recording is already started");
+	}
+	recorder = rec.release();
+}
+
+uint64_t window_base::stop_recording()
+{
+	boost::mutex::scoped_lock lock(recorder_mutex);
+	std::unique_ptr<event_recorder> rec(recorder.exchange(nullptr));
+	return rec? rec->count() : 0;
+}
+
+// Spin lock for event producers, they are almost never contended
+class post_guard
+{
+public:
+	explicit post_guard(boost::atomic<bool>& lock)
+		: lock_(lock)
+	{
+		while (lock_.exchange(true, boost::memory_order_acquire))
+		{
+			boost::this_thread::yield();
+		}
+	}
+
+	~post_guard()
+	{
+		lock_.store(false, boost::memory_order_release);
+	}
+
+private:
+	boost::atomic<bool>& lock_;
+};
+
+// Windows by id, to find route sources from other runtimes
+static std::map<uint32_t, window_base*> windows;
+static boost::mutex windows_mutex;
+
+event_target::event_target(runtime& rt)
+	: rt_(rt)
+	, names_(string_cache::instance(rt.isolate()))
+	, reuse_events_(false)
+	, find_js_object_(nullptr)
+	, event_order_(0)
+	, events_pending_(false)
+	, self_(boost::make_shared<event_target*>(this))
+	, queue_lock_(false)
+	, queue_limit_(EVENT_QUEUE_SIZE * 3 / 4)
+	, queue_high_water_(0)
+	, queue_dropped_(0)
+	, queue_coalesced_(0)
+	, listener_mask_(0)
+{
+	set_js_class<window>();
+
+	for (size_t i = 0; i < LISTENER_TABLE_SIZE; ++i)
+	{
+		queue_policies_[i] = QUEUE_KEEP;
+	}
+	// Stale pointer positions and sizes are useless after a stall,
+	// accumulated motion remains available in the pointer state
+	queue_policies_[input_event::MOUSE_MOVE] = QUEUE_LATEST;
+	queue_policies_[RESIZE_EVENT] = QUEUE_LATEST;
+	queue_policies_[MOVE_EVENT] = QUEUE_LATEST;
+	queue_policies_[FRAME_EVENT] = QUEUE_LATEST;
+	for (latest_slot& slot : latest_events_)
+	{
+		slot.is_set = false;
+	}
+
+	std::fill(event_pool_next_, event_pool_next_ + input_event::EVENT_TYPE_COUNT, 0);
+}
+
+event_target::~event_target()
+{
+	for (size_t i = 0; i < LISTENER_TABLE_SIZE; ++i)
+	{
+		listeners_[i].clear();
+	}
+	named_listeners_.clear();
+	for (size_t i = 0; i < input_event::EVENT_TYPE_COUNT; ++i)
+	{
+		event_pool_[i].clear();
+	}
+}
+
+window_base::window_base(runtime& rt)
+	: event_target(rt)
+	, size_(0, 0)
+	, style_(0)
+	, id_(++window_ids)
+	, replaying_(false)
+	, post_lock_(false)
+	, pointer_region_(0)
+	, pointer_inside_(false)
+	, pointer_moved_(false)
+{
+	std::fill(routes_, routes_ + LISTENER_TABLE_SIZE, nullptr);
+
+	keyboard_state_data_ = create_shared_array<v8::Uint32Array, uint32_t>(rt_.isolate(),
+		keyboard_state_, KEYBOARD_STATE_SIZE);
+	pointer_state_data_ = create_shared_array<v8::Int32Array, int32_t>(rt_.isolate(),
+		pointer_state_, POINTER_STATE_SIZE);
+
+	boost::mutex::scoped_lock lock(windows_mutex);
+	windows[id_] = this;
+}
 
-		if (has(inp_e.type_str()))
+window_base::~window_base()
+{
+	stop_replay();
+	{
+		boost::mutex::scoped_lock lock(windows_mutex);
+		windows.erase(id_);
+		for (size_t i = 0; i < LISTENER_TABLE_SIZE; ++i)
 		{
-			rt_.main_loop().schedule(boost::bind(&window::on_input_v8, this, inp_e));
+			if (routes_[i])
+			{
+				routes_[i]->window_ = nullptr;
+			}
 		}
 	}
+	release_shared_array(rt_.isolate(), keyboard_state_, keyboard_state_data_);
+	release_shared_array(rt_.isolate(), pointer_state_, pointer_state_data_);
 }
 
-void window_base::on_event(std::string const& type)
+event_route::event_route(v8::FunctionCallbackInfo<v8::Value> const& args)
+	: event_target(runtime::instance(args.GetIsolate()))
+	, window_id_(v8pp::from_v8<uint32_t>(args.GetIsolate(), args[0]))
+	, window_(nullptr)
+{
+	set_js_class<event_route>();
+
+	std::vector<int> types;
+	std::vector<std::string> const names = v8pp::from_v8<std::vector<std::string>>(args.GetIsolate(), args[1]);
+	for (std::string const& name : names)
+	{
+		int const index = listener_index(name);
+		if (index <= input_event::UNKNOWN)
+		{
+			throw std::invalid_argument("unknown event type " + name);
+		}
+		types.push_back(index);
+	}
+
+	boost::mutex::scoped_lock lock(windows_mutex);
+	std::map<uint32_t, window_base*>::const_iterator const it = windows.find(window_id_);
+	if (it == windows.end())
+	{
+		throw std::invalid_argument("no window with the id");
+	}
+
+	window_base& wnd = *it->second;
+	post_guard guard(wnd.post_lock_);
+	for (size_t i = 0; i < types.size(); ++i)
+	{
+		if (wnd.routes_[types[i]])
+		{
+			throw std::runtime_error("event type is already routed " + names[i]);
+		}
+	}
+	for (int index : types)
+	{
+		wnd.routes_[index] = this;
+	}
+	window_ = &wnd;
+}
+
+void event_route::close()
 {
-	if (has(type))
+	boost::mutex::scoped_lock lock(windows_mutex);
+	if (window_)
 	{
-		rt_.main_loop().schedule(boost::bind(&window::on_event_v8, this, type));
+		post_guard guard(window_->post_lock_);
+		for (size_t i = 0; i < LISTENER_TABLE_SIZE; ++i)
+		{
+			if (window_->routes_[i] == this)
+			{
+				window_->routes_[i] = nullptr;
+			}
+		}
+		window_ = nullptr;
 	}
 }
 
-void window_base::on_resize_v8(box<int> new_size)
+int event_target::listener_index(std::string const& name)
 {
-	v8::Isolate* isolate = rt_.isolate();
-	v8::HandleScope scope(isolate);
+	input_event::event_type const type = input_event::type_from_str(name);
+	if (type != input_event::UNKNOWN)
+	{
+		return type;
+	}
+	for (size_t i = 0; i < window_event_count; ++i)
+	{
+		if (window_events[i] == name)
+		{
+			return static_cast<int>(RESIZE_EVENT + i);
+		}
+	}
+	return -1;
+}
+
+event_target::listener_list* event_target::find_listeners(std::string const& name)
+{
+	int const index = listener_index(name);
+	if (index >= 0)
+	{
+		return &listeners_[index];
+	}
+	auto const it = named_listeners_.find(name);
+	return it != named_listeners_.end()? &it->second : nullptr;
+}
+
+void event_target::update_listener_mask(int index)
+{
+	if (index < 0)
+	{
+		return;
+	}
+	if (listeners_[index].empty())
+	{
+		listener_mask_ &= ~(1u << index);
+	}
+	else
+	{
+		listener_mask_ |= (1u << index);
+	}
+}
+
+void event_target::add_listener(v8::Isolate* isolate, std::string const& name, v8::Handle<v8::Function> fn, bool once)
+{
+	if (fn.IsEmpty())
+	{
+		return;
+	}
+
+	listener item;
+	item.fn.Reset(isolate, fn);
+	item.once = once;
+
+	int const index = listener_index(name);
+	listener_list& listeners = (index >= 0)? listeners_[index] : named_listeners_[name];
+	listeners.push_back(item);
+	update_listener_mask(index);
+}
+
+void event_target::on(v8::Isolate* isolate, std::string const& name, v8::Handle<v8::Function> fn)
+{
+	add_listener(isolate, name, fn, false);
+}
+
+void event_target::once(v8::Isolate* isolate, std::string const& name, v8::Handle<v8::Function> fn)
+{
+	add_listener(isolate, name, fn, true);
+}
+
+void event_target::off(v8::Isolate*, std::string const& name)
+{
+	int const index = listener_index(name);
+	if (index >= 0)
+	{
+		listeners_[index].clear();
+		update_listener_mask(index);
+	}
+	else
+	{
+		named_listeners_.erase(name);
+	}
+}
+
+void event_target::remove_listener(v8::Isolate*, std::string const& name, v8::Handle<v8::Function> fn)
+{
+	listener_list* listeners = find_listeners(name);
+	if (!listeners || fn.IsEmpty())
+	{
+		return;
+	}
+
+	auto const it = std::find_if(listeners->rbegin(), listeners->rend(),
+		[&fn](listener const& item) { return item.fn == fn; });
+	if (it != listeners->rend())
+	{
+		listeners->erase(std::next(it).base());
+		update_listener_mask(listener_index(name));
+	}
+}
+
+bool event_target::has(std::string const& name) const
+{
+	int const index = listener_index(name);
+	if (index >= 0)
+	{
+		return !listeners_[index].empty();
+	}
+	auto const it = named_listeners_.find(name);
+	return it != named_listeners_.end() && !it->second.empty();
+}
 
-	v8::Handle<v8::Value> args[1] = { v8pp::to_v8(isolate, new_size) };
-	emit(isolate, "resize", 1, args);
+size_t event_target::emit(v8::Isolate*, std::string const& name, int argc, v8::Handle<v8::Value> argv[])
+{
+	int const index = listener_index(name);
+	if (index >= 0)
+	{
+		size_t const count = call_listeners(listeners_[index], argc, argv);
+		update_listener_mask(index);
+		return count;
+	}
+
+	auto const it = named_listeners_.find(name);
+	return it != named_listeners_.end()? call_listeners(it->second, argc, argv) : 0;
+}
+
+void event_target::once_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
+{
+	v8::Isolate* isolate = args.GetIsolate();
+	once(isolate, v8pp::from_v8<std::string>(isolate, args[0]), args[1].As<v8::Function>());
+	args.GetReturnValue().Set(args.This());
+}
+
+void event_target::remove_listener_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
+{
+	v8::Isolate* isolate = args.GetIsolate();
+	remove_listener(isolate, v8pp::from_v8<std::string>(isolate, args[0]), args[1].As<v8::Function>());
+	args.GetReturnValue().Set(args.This());
+}
+
+void event_target::remove_all_listeners_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
+{
+	v8::Isolate* isolate = args.GetIsolate();
+	if (args.Length() > 0 && !args[0]->IsUndefined())
+	{
+		off(isolate, v8pp::from_v8<std::string>(isolate, args[0]));
+	}
+	else
+	{
+		for (int index = 0; index < LISTENER_TABLE_SIZE; ++index)
+		{
+			listeners_[index].clear();
+		}
+		listener_mask_ = 0;
+		named_listeners_.clear();
+	}
+	args.GetReturnValue().Set(args.This());
+}
+
+void event_target::emit_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
+{
+	v8::Isolate* isolate = args.GetIsolate();
+	std::string const name = v8pp::from_v8<std::string>(isolate, args[0]);
+
+	std::vector<v8::Handle<v8::Value>> argv;
+	for (int i = 1; i < args.Length(); ++i)
+	{
+		argv.push_back(args[i]);
+	}
+	size_t const count = emit(isolate, name, static_cast<int>(argv.size()), argv.data());
+	args.GetReturnValue().Set(count != 0);
 }
 
-void window_base::on_input_v8(input_event inp_e)
+v8::Handle<v8::Value> event_target::event_object(input_event const& inp_e)
 {
 	v8::Isolate* isolate = rt_.isolate();
-	v8::HandleScope scope(isolate);
+	if (!reuse_events_)
+	{
+		return inp_e.to_v8(isolate, names_);
+	}
 
-	v8::Handle<v8::Value> args[1] = { inp_e.to_v8(isolate) };
-	emit(isolate, inp_e.type_str(), 1, args);
+	// Listeners must not keep the event past the call, the object
+	// is overwritten by a later event of the same type
+	std::vector<event_object_ref>& pool = event_pool_[inp_e.type()];
+	size_t& next = event_pool_next_[inp_e.type()];
+	if (pool.size() < EVENT_POOL_SIZE)
+	{
+		v8::Local<v8::Object> object = inp_e.to_v8(isolate, names_).As<v8::Object>();
+		pool.push_back(event_object_ref(isolate, object));
+		return object;
+	}
+
+	v8::Local<v8::Object> object = v8::Local<v8::Object>::New(isolate, pool[next]);
+	next = (next + 1) % EVENT_POOL_SIZE;
+	inp_e.to_v8(isolate, object, names_);
+	return object;
+}
+
+bool event_target::call_listeners(int index, int argc, v8::Handle<v8::Value> argv[])
+{
+	if (listeners_[index].empty())
+	{
+		return false;
+	}
+	call_listeners(listeners_[index], argc, argv);
+	update_listener_mask(index);
+	return true;
+}
+
+size_t event_target::call_listeners(listener_list& listeners, int argc, v8::Handle<v8::Value> argv[])
+{
+	if (listeners.empty())
+	{
+		return 0;
+	}
+
+	v8::Isolate* isolate = rt_.isolate();
+	v8::HandleScope scope(isolate);
+	v8::Handle<v8::Value> recv = find_js_object_(isolate, this);
+	if (recv.IsEmpty())
+	{
+		recv = v8::Undefined(isolate);
+	}
+
+	// a listener may add or remove listeners for the same event, re-check the size
+	size_t count = 0;
+	for (size_t i = 0; i < listeners.size(); ++count)
+	{
+		v8::Local<v8::Function> fn = v8::Local<v8::Function>::New(isolate, listeners[i].fn);
+		if (listeners[i].once)
+		{
+			listeners.erase(listeners.begin() + i);
+		}
+		else
+		{
+			++i;
+		}
+
+		v8::TryCatch try_catch(isolate);
+		fn->Call(recv, argc, argv);
+		if (try_catch.HasCaught())
+		{
+			v8::String::Utf8Value const exception(try_catch.Exception());
+			v8::Handle<v8::Message> const message = try_catch.Message();
+			std::cerr << "Uncaught exception in event listener: " << (*exception? *exception : "<unknown>");
+			if (!message.IsEmpty())
+			{
+				v8::String::Utf8Value const resource(message->GetScriptResourceName());
+				std::cerr << " at " << (*resource? *resource : "<unknown>") << ':' << message->GetLineNumber();
+			}
+			std::cerr << std::endl;
+		}
+	}
+	return count;
+}
+
+v8::Handle<v8::Uint32Array> window_base::keyboard_state() const
+{
+	return v8::Local<v8::Uint32Array>::New(rt_.isolate(), keyboard_state_);
+}
+
+v8::Handle<v8::Int32Array> window_base::pointer_state() const
+{
+	return v8::Local<v8::Int32Array>::New(rt_.isolate(), pointer_state_);
+}
+
+void window_base::update_keyboard_state(input_event const& inp_e)
+{
+	if (inp_e.type() == input_event::KEY_DOWN || inp_e.type() == input_event::KEY_UP)
+	{
+#if OS(WINDOWS)
+		// scan code in bits 16..22 of LPARAM, extended key flag in bit 24
+		uint32_t const index = ((inp_e.scan_code() >> 16) & 0x7F) | ((inp_e.scan_code() >> 17) & 0x80);
+#else
+		uint32_t const index = inp_e.scan_code() & 0xFF;
+#endif
+		uint32_t const bit = 1u << (index % 32);
+		uint32_t& word = keyboard_state_data_[index / 32];
+		word = (inp_e.type() == input_event::KEY_DOWN? word | bit : word & ~bit);
+	}
+	keyboard_state_data_[KEYBOARD_MODIFIERS] = inp_e.modifiers();
+}
+
+// Add with wrap around, as JavaScript reader does with `|0`
+static void accumulate(int32_t& total, int delta)
+{
+	total = static_cast<int32_t>(static_cast<uint32_t>(total) + static_cast<uint32_t>(delta));
+}
+
+void window_base::update_pointer_state(input_event const& inp_e)
+{
+	if (!inp_e.is_mouse())
+	{
+		return;
+	}
+
+	int32_t* const state = pointer_state_data_;
+
+	// Sequence lock: the sequence is odd while the state is written
+	accumulate(state[POINTER_SEQUENCE], 1);
+	boost::atomic_thread_fence(boost::memory_order_release);
+
+	uint32_t buttons = inp_e.modifiers() & 0xF8;
+	if (inp_e.button() >= 1 && inp_e.button() <= 5)
+	{
+		// Event state may not include the button just pressed or released
+		uint32_t const button_bit = 0x08 << (inp_e.button() - 1);
+		if (inp_e.type() == input_event::MOUSE_DOWN) buttons |= button_bit;
+		if (inp_e.type() == input_event::MOUSE_UP) buttons &= ~button_bit;
+	}
+	state[POINTER_BUTTONS] = buttons;
+
+	switch (inp_e.type())
+	{
+	case input_event::MOUSE_WHEEL:
+		accumulate(state[POINTER_WHEEL_X], inp_e.dx());
+		accumulate(state[POINTER_WHEEL_Y], inp_e.dy());
+		break;
+	case input_event::MOUSE_MOVE:
+		if (inp_e.dx() || inp_e.dy())
+		{
+			// relative motion
+			accumulate(state[POINTER_MOTION_X], inp_e.dx());
+			accumulate(state[POINTER_MOTION_Y], inp_e.dy());
+		}
+		else if (pointer_moved_)
+		{
+			accumulate(state[POINTER_MOTION_X], inp_e.x() - state[POINTER_X]);
+			accumulate(state[POINTER_MOTION_Y], inp_e.y() - state[POINTER_Y]);
+		}
+		pointer_moved_ = true;
+		break;
+	default:
+		break;
+	}
+
+	state[POINTER_X] = inp_e.x();
+	state[POINTER_Y] = inp_e.y();
+
+	boost::atomic_thread_fence(boost::memory_order_release);
+	accumulate(state[POINTER_SEQUENCE], 1);
+}
+
+class window_base::region_grid
+{
+public:
+	// Number of Int32Array elements in a region record
+	static size_t const RECORD_SIZE = 6;
+
+	region_grid(int32_t const* records, size_t count);
+
+	// Topmost region id at a point, 0 if none
+	uint32_t find(int x, int y) const;
+
+private:
+	struct region
+	{
+		uint32_t id;
+		int32_t z;
+		int64_t left, top, right, bottom;
+
+		bool contains(int x, int y) const
+		{
+			return x >= left && x < right && y >= top && y < bottom;
+		}
+	};
+
+	// Cells are at least CELL_SIZE pixels, at most MAX_CELLS in a row or a column
+	static int64_t const CELL_SIZE = 64;
+	static int64_t const MAX_CELLS = 64;
+
+	std::vector<region> regions_; // topmost first
+	int64_t left_, top_, cell_width_, cell_height_;
+	size_t cols_, rows_;
+
+	// Region indices of cell i are cell_regions_[cell_start_[i] .. cell_start_[i + 1]), topmost first
+	std::vector<uint32_t> cell_start_;
+	std::vector<uint32_t> cell_regions_;
+};
+
+window_base::region_grid::region_grid(int32_t const* records, size_t count)
+	: left_(0), top_(0), cell_width_(1), cell_height_(1)
+	, cols_(0), rows_(0)
+{
+	regions_.reserve(count);
+	for (size_t i = count; i > 0; --i)
+	{
+		int32_t const* const rec = records + (i - 1) * RECORD_SIZE;
+		if (rec[0] == 0)
+		{
+			throw std::invalid_argument("region id 0 is reserved");
+		}
+		if (rec[4] < 0 || rec[5] < 0)
+		{
+			throw std::invalid_argument("negative region size");
+		}
+		if (rec[4] > 0 && rec[5] > 0)
+		{
+			region const r = { static_cast<uint32_t>(rec[0]), rec[1],
+				rec[2], rec[3], int64_t(rec[2]) + rec[4], int64_t(rec[3]) + rec[5] };
+			regions_.push_back(r);
+		}
+	}
+	if (regions_.empty())
+	{
+		return;
+	}
+
+	// Regions were added from the last one, keep it first among equal z
+	std::stable_sort(regions_.begin(), regions_.end(),
+		[](region const& a, region const& b) { return a.z > b.z; });
+
+	left_ = top_ = std::numeric_limits<int64_t>::max();
+	int64_t right = std::numeric_limits<int64_t>::min(), bottom = right;
+	for (region const& r : regions_)
+	{
+		left_ = std::min(left_, r.left);
+		top_ = std::min(top_, r.top);
+		right = std::max(right, r.right);
+		bottom = std::max(bottom, r.bottom);
+	}
+
+	int64_t const cols = std::min(int64_t(MAX_CELLS), (right - left_ + CELL_SIZE - 1) / CELL_SIZE);
+	int64_t const rows = std::min(int64_t(MAX_CELLS), (bottom - top_ + CELL_SIZE - 1) / CELL_SIZE);
+	cell_width_ = (right - left_ + cols - 1) / cols;
+	cell_height_ = (bottom - top_ + rows - 1) / rows;
+	cols_ = static_cast<size_t>(cols);
+	rows_ = static_cast<size_t>(rows);
+
+	// Count regions per cell, then fill the cells in the topmost first order
+	cell_start_.assign(cols_ * rows_ + 1, 0);
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		std::vector<uint32_t> fill(cell_start_.begin(), cell_start_.end() - 1);
+		for (size_t i = 0; i < regions_.size(); ++i)
+		{
+			region const& r = regions_[i];
+			size_t const col_end = static_cast<size_t>((r.right - 1 - left_) / cell_width_);
+			size_t const row_end = static_cast<size_t>((r.bottom - 1 - top_) / cell_height_);
+			for (size_t row = static_cast<size_t>((r.top - top_) / cell_height_); row <= row_end; ++row)
+			{
+				for (size_t col = static_cast<size_t>((r.left - left_) / cell_width_); col <= col_end; ++col)
+				{
+					size_t const cell = row * cols_ + col;
+					if (pass == 0)
+					{
+						++cell_start_[cell + 1];
+					}
+					else
+					{
+						cell_regions_[fill[cell]++] = static_cast<uint32_t>(i);
+					}
+				}
+			}
+		}
+		if (pass == 0)
+		{
+			std::partial_sum(cell_start_.begin(), cell_start_.end(), cell_start_.begin());
+			cell_regions_.resize(cell_start_.back());
+		}
+	}
+}
+
+uint32_t window_base::region_grid::find(int x, int y) const
+{
+	if (x < left_ || y < top_)
+	{
+		return 0;
+	}
+	size_t const col = static_cast<size_t>((x - left_) / cell_width_);
+	size_t const row = static_cast<size_t>((y - top_) / cell_height_);
+	if (col >= cols_ || row >= rows_)
+	{
+		return 0;
+	}
+
+	size_t const cell = row * cols_ + col;
+	for (uint32_t i = cell_start_[cell], end = cell_start_[cell + 1]; i != end; ++i)
+	{
+		region const& r = regions_[cell_regions_[i]];
+		if (r.contains(x, y))
+		{
+			return r.id;
+		}
+	}
+	return 0;
+}
+
+void window_base::set_regions(v8::Handle<v8::Value> regions)
+{
+	if (!regions->IsInt32Array())
+	{
+		throw std::invalid_argument("required Int32Array regions argument");
+	}
+	v8::Handle<v8::Int32Array> array = regions.As<v8::Int32Array>();
+	if (array->Length() % region_grid::RECORD_SIZE)
+	{
+		throw std::invalid_argument("regions length is not a multiple of 6");
+	}
+	int32_t const* data = reinterpret_cast<int32_t const*>(
+		static_cast<char const*>(array->Buffer()->GetContents().Data()) + array->ByteOffset());
+	replace_regions(region_grid_ptr(new region_grid(data, array->Length() / region_grid::RECORD_SIZE)));
+}
+
+void window_base::clear_regions()
+{
+	replace_regions(region_grid_ptr());
+}
+
+uint32_t window_base::region_at(int x, int y) const
+{
+	region_grid_ptr const grid = regions();
+	return grid? grid->find(x, y) : 0;
+}
+
+window_base::region_grid_ptr window_base::regions() const
+{
+	return boost::atomic_load(&regions_);
+}
+
+void window_base::replace_regions(region_grid_ptr const& regions)
+{
+	post_guard guard(post_lock_);
+	boost::atomic_store(&regions_, regions);
+
+	// The region under a still pointer may change with the regions
+	if (pointer_inside_)
+	{
+		int const x = pointer_state_data_[POINTER_X];
+		int const y = pointer_state_data_[POINTER_Y];
+		change_pointer_region(regions? regions->find(x, y) : 0, 0,
+			keyboard_state_data_[KEYBOARD_MODIFIERS], x, y);
+	}
+}
+
+void window_base::hit_test(input_event& inp_e)
+{
+	if (inp_e.type() == input_event::MOUSE_REGION_ENTER || inp_e.type() == input_event::MOUSE_REGION_LEAVE)
+	{
+		// injected or replayed transition
+		return;
+	}
+
+	uint32_t const region = region_at(inp_e.x(), inp_e.y());
+	inp_e.region() = region;
+
+	pointer_inside_ = true;
+	change_pointer_region(region, inp_e.button(), inp_e.modifiers(), inp_e.x(), inp_e.y());
+}
+
+void window_base::on_pointer_leave(int x, int y)
+{
+	post_guard guard(post_lock_);
+
+	pointer_inside_ = false;
+	change_pointer_region(0, 0, keyboard_state_data_[KEYBOARD_MODIFIERS], x, y);
+}
+
+void window_base::change_pointer_region(uint32_t region, uint32_t button, uint32_t modifiers, int x, int y)
+{
+	uint32_t const prev_region = pointer_region_;
+	if (region == prev_region)
+	{
+		return;
+	}
+	pointer_region_ = region;
+
+	// Transitions are posted before the event that caused them
+	queued_event ev;
+	if (prev_region)
+	{
+		ev.type = input_event::MOUSE_REGION_LEAVE;
+		ev.input = input_event::mouse(input_event::MOUSE_REGION_LEAVE, button, modifiers, x, y);
+		ev.input.region() = prev_region;
+		deliver(ev);
+	}
+	if (region)
+	{
+		ev.type = input_event::MOUSE_REGION_ENTER;
+		ev.input = input_event::mouse(input_event::MOUSE_REGION_ENTER, button, modifiers, x, y);
+		ev.input.region() = region;
+		deliver(ev);
+	}
+}
+
+void window_base::reset_keyboard_state()
+{
+	post_guard guard(post_lock_);
+	std::fill(keyboard_state_data_, keyboard_state_data_ + KEYBOARD_STATE_SIZE, 0);
+}
+
+void window_base::replay(std::string const& filename, double speed, uint32_t window_id)
+{
+	if (speed < 0)
+	{
+		throw std::invalid_argument("negative replay speed");
+	}
+
+	stop_replay();
+	replaying_ = true;
+	try
+	{
+		player_.reset(new event_player(*this, filename, speed, window_id));
+	}
+	catch (...)
+	{
+		replaying_ = false;
+		throw;
+	}
+}
+
+void window_base::replay_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
+{
+	v8::Isolate* isolate = args.GetIsolate();
+	std::string const filename = v8pp::from_v8<std::string>(isolate, args[0]);
+	double const speed = args[1]->IsUndefined()? 1.0 : v8pp::from_v8<double>(isolate, args[1]);
+	uint32_t const window_id = args[2]->IsUndefined()? 0 : v8pp::from_v8<uint32_t>(isolate, args[2]);
+	replay(filename, speed, window_id);
+}
+
+void window_base::stop_replay()
+{
+	player_.reset();
+	replaying_ = false;
+}
+
+void window_base::on_resize(box<int> const& new_size)
+{
+	process_resize(new_size);
+}
+
+void window_base::on_input(input_event const& inp_e)
+{
+	if (!replaying_)
+	{
+		process_input(inp_e);
+	}
+}
+
+void window_base::on_event(window_event type)
+{
+	process_event(type);
+}
+
+void window_base::process_resize(box<int> const& new_size)
+{
+	post_guard guard(post_lock_);
+
+	event_record record = event_record();
+	record.window = id_;
+	record.type = RESIZE_EVENT;
+	record.data[0] = new_size.width;
+	record.data[1] = new_size.height;
+	record_event(record);
+
+	std::for_each(event_sinks_.begin(), event_sinks_.end(),
+		[&new_size](event_sink* sink) { sink->on_resize(new_size); });
+
+	queued_event ev;
+	ev.type = RESIZE_EVENT;
+	ev.width = new_size.width;
+	ev.height = new_size.height;
+	deliver(ev);
+}
+
+void window_base::on_screen_change()
+{
+	post_guard guard(post_lock_);
+
+	std::for_each(event_sinks_.begin(), event_sinks_.end(),
+		[](event_sink* sink) { sink->on_screen_change(); });
+}
+
+void window_base::process_input(input_event const& inp_e)
+{
+	if (inp_e.type() != input_event::UNKNOWN)
+	{
+		post_guard guard(post_lock_);
+
+		input_event e(inp_e);
+		if (e.is_mouse())
+		{
+			hit_test(e);
+		}
+
+		event_record record = event_record();
+		record.window = id_;
+		record.type = e.type();
+		e.pack(record.data);
+		record_event(record);
+
+		update_keyboard_state(e);
+		update_pointer_state(e);
+
+		std::for_each(event_sinks_.begin(), event_sinks_.end(),
+			[&e](event_sink* sink) { sink->on_input(e); });
+
+		queued_event ev;
+		ev.type = e.type();
+		ev.input = e;
+		deliver(ev);
+	}
+}
+
+void window_base::process_event(window_event type)
+{
+	post_guard guard(post_lock_);
+
+	event_record record = event_record();
+	record.window = id_;
+	record.type = type;
+	record_event(record);
+
+	queued_event ev;
+	ev.type = type;
+	deliver(ev);
+}
+
+void window_base::on_event(std::string const& type)
+{
+	int const index = listener_index(type);
+	if (index >= RESIZE_EVENT)
+	{
+		on_event(static_cast<window_event>(index));
+	}
+	else
+	{
+		emit_later(type);
+	}
+}
+
+void window_base::deliver(queued_event const& ev)
+{
+	event_target* target = routes_[ev.type];
+	if (!target)
+	{
+		target = this;
+	}
+	if (target->has_listeners(ev.type))
+	{
+		target->post_event(ev);
+	}
+}
+
+void event_target::emit_later(std::string const& type)
+{
+	// Named listeners are checked in the runtime thread, they are not synchronized
+	rt_.main_loop().schedule(boost::bind(&event_target::scheduled_event, boost::weak_ptr<event_target*>(self_), type));
+}
+
+void event_target::scheduled_event(boost::weak_ptr<event_target*> const& self, std::string const& type)
+{
+	if (boost::shared_ptr<event_target*> target = self.lock())
+	{
+		(*target)->on_event_v8(type);
+	}
+}
+
+static char const* const queue_policies[] = { "keep", "latest", "drop" };
+
+void event_target::set_queue_policy(std::string const& type, std::string const& policy)
+{
+	int const index = listener_index(type);
+	if (index <= input_event::UNKNOWN)
+	{
+		throw std::invalid_argument("unknown event type " + type);
+	}
+
+	for (size_t i = 0; i < sizeof queue_policies / sizeof(*queue_policies); ++i)
+	{
+		if (queue_policies[i] == policy)
+		{
+			queue_policies_[index] = static_cast<int>(i);
+			return;
+		}
+	}
+	throw std::invalid_argument("unknown queue policy " + policy);
+}
+
+void event_target::set_queue_limit(unsigned limit)
+{
+	if (limit == 0 || limit > EVENT_QUEUE_SIZE)
+	{
+		throw std::invalid_argument("queue limit out of range");
+	}
+	queue_limit_ = limit;
+}
+
+v8::Handle<v8::Object> event_target::queue_stats() const
+{
+	v8::Isolate* isolate = rt_.isolate();
+	v8::EscapableHandleScope scope(isolate);
+
+	v8::Local<v8::Object> result = v8::Object::New(isolate);
+	set_option(isolate, result, "size", static_cast<double>(discrete_events_.size() + continuous_events_.size()));
+	set_option(isolate, result, "limit", static_cast<double>(queue_limit_));
+	set_option(isolate, result, "capacity", static_cast<double>(EVENT_QUEUE_SIZE));
+	set_option(isolate, result, "highWater", static_cast<double>(queue_high_water_));
+	set_option(isolate, result, "dropped", static_cast<double>(queue_dropped_));
+	set_option(isolate, result, "coalesced", static_cast<double>(queue_coalesced_));
+	return scope.Escape(result);
+}
+
+bool event_target::is_continuous(int type)
+{
+	switch (type)
+	{
+	case input_event::MOUSE_MOVE:
+	case input_event::MOUSE_WHEEL:
+	case RESIZE_EVENT:
+	case MOVE_EVENT:
+	case FRAME_EVENT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void event_target::post_event(queued_event ev)
+{
+	bool const is_latest = is_continuous(ev.type) && queue_policies_[ev.type] == QUEUE_LATEST;
+	{
+		post_guard guard(queue_lock_);
+
+		if (is_latest)
+		{
+			// The newest event is never refused, it supersedes a not yet drained one
+			latest_slot& slot = latest_events_[ev.type];
+			if (slot.is_set)
+			{
+				++queue_coalesced_;
+			}
+			ev.order = event_order_++;
+			slot.event = ev;
+			slot.is_set = true;
+		}
+		else
+		{
+			spsc_queue<queued_event, EVENT_QUEUE_SIZE>& lane = is_continuous(ev.type)?
+				continuous_events_ : discrete_events_;
+
+			// Only the producer grows the queue, so a size checked here
+			// can only shrink until the push below
+			size_t const size = lane.size();
+			if (size >= EVENT_QUEUE_SIZE || (queue_policies_[ev.type] != QUEUE_KEEP && size >= queue_limit_))
+			{
+				++queue_dropped_;
+				return;
+			}
+			ev.order = event_order_++;
+			lane.push(ev);
+		}
+	}
+
+	size_t const total = discrete_events_.size() + continuous_events_.size();
+	if (total > queue_high_water_)
+	{
+		queue_high_water_ = total;
+	}
+
+	if (!events_pending_.exchange(true))
+	{
+		rt_.main_loop().schedule(boost::bind(&event_target::scheduled_drain, boost::weak_ptr<event_target*>(self_)));
+	}
+}
+
+void event_target::scheduled_drain(boost::weak_ptr<event_target*> const& self)
+{
+	if (boost::shared_ptr<event_target*> target = self.lock())
+	{
+		(*target)->drain_events();
+	}
+}
+
+// Event order numbers wrap around
+static bool is_before(uint32_t order, uint32_t other)
+{
+	return static_cast<int32_t>(order - other) < 0;
+}
+
+void event_target::drain_events()
+{
+	// Clear the flag before draining, a later event schedules the next drain
+	events_pending_.exchange(false);
+
+	// Take the latest events and limit the drain to already queued events,
+	// the event thread keeps adding them
+	queued_event latest[LISTENER_TABLE_SIZE];
+	size_t latest_count = 0;
+	size_t discrete_count, continuous_count;
+	{
+		post_guard guard(queue_lock_);
+		for (latest_slot& slot : latest_events_)
+		{
+			if (slot.is_set)
+			{
+				latest[latest_count++] = slot.event;
+				slot.is_set = false;
+			}
+		}
+		discrete_count = discrete_events_.size();
+		continuous_count = continuous_events_.size();
+	}
+	std::sort(latest, latest + latest_count,
+		[](queued_event const& lhs, queued_event const& rhs) { return is_before(lhs.order, rhs.order); });
+
+	// Merge the lanes and the latest events in order
+	queued_event ev;
+	for (size_t latest_index = 0;;)
+	{
+		queued_event const* discrete = discrete_count? discrete_events_.front() : nullptr;
+		queued_event const* continuous = continuous_count? continuous_events_.front() : nullptr;
+		queued_event const* next_latest = (latest_index < latest_count)? &latest[latest_index] : nullptr;
+
+		if (discrete && (!continuous || is_before(discrete->order, continuous->order))
+			&& (!next_latest || is_before(discrete->order, next_latest->order)))
+		{
+			discrete_events_.pop(ev);
+			--discrete_count;
+		}
+		else if (continuous && (!next_latest || is_before(continuous->order, next_latest->order)))
+		{
+			continuous_events_.pop(ev);
+			--continuous_count;
+
+			// Merge the following events of the type while a discrete event waits behind them
+			while (discrete && continuous_count)
+			{
+				continuous = continuous_events_.front();
+				if (!continuous || continuous->type != ev.type || !is_before(continuous->order, discrete->order)
+					|| (next_latest && !is_before(continuous->order, next_latest->order)))
+				{
+					break;
+				}
+				queued_event const prev = ev;
+				continuous_events_.pop(ev);
+				--continuous_count;
+				if (ev.input.is_mouse())
+				{
+					ev.input.dx() += prev.input.dx();
+					ev.input.dy() += prev.input.dy();
+				}
+				++queue_coalesced_;
+			}
+		}
+		else if (next_latest)
+		{
+			ev = *next_latest;
+			++latest_index;
+		}
+		else
+		{
+			break;
+		}
+		dispatch_event(ev);
+	}
+}
+
+void event_target::dispatch_event(queued_event const& ev)
+{
+	v8::Isolate* isolate = rt_.isolate();
+	v8::HandleScope scope(isolate);
+
+	if (ev.type == RESIZE_EVENT)
+	{
+		v8::Handle<v8::Value> args[1] = { v8pp::to_v8(isolate, box<int>(ev.width, ev.height)) };
+		call_listeners(RESIZE_EVENT, 1, args);
+	}
+	else if (ev.type < input_event::EVENT_TYPE_COUNT)
+	{
+		v8::Handle<v8::Value> args[1] = { event_object(ev.input) };
+		call_listeners(ev.type, 1, args);
+	}
+	else
+	{
+		call_listeners(ev.type, 0, nullptr);
+	}
 }
 
-void window_base::on_event_v8(std::string type)
+void event_target::on_event_v8(std::string type)
 {
+	v8::HandleScope scope(rt_.isolate());
 	emit(rt_.isolate(), type, 0, nullptr);
 }
 
@@ -1,5 +1,6 @@
 #include "oxygen/oxygen.hpp"
 #include "oxygen/gui.mac.hpp"
+#include "oxygen/keys.hpp"
 
 @interface window_delegate : NSObject
 {
@@ -335,6 +336,7 @@ window::window(v8::FunctionCallbackInfo<v8::Value> const& args)
 void window::create(creation_args args)
 {
 	style_ = args.style;
+	reuse_events_ = args.reuse_events;
 	style_mask_ = 0;
 	fullscreen_ = false;
 
@@ -390,6 +392,8 @@ void window::create(creation_args args)
 
 void window::destroy()
 {
+	stop_replay();
+
 	[object setDelegate:nil];
 	[delegate release];
 	delegate = nil;
@@ -724,10 +728,11 @@ void window::handle_backing_change()
 
 void window::handle_close()
 {
-	on_event("close");
+	on_event(CLOSE_EVENT);
 }
 
 input_event::input_event(event const& e)
+	: region_(0)
 {
 	NSEventType const type = [e type];
 
@@ -793,6 +798,7 @@ input_event::input_event(event const& e)
 			data_.key.vk_code = data_.key.key_code = data_.key.scan_code = [e keyCode];
 			NSString* str = [e charactersIgnoringModifiers];
 			data_.key.char_code = [str length] > 0? [str characterAtIndex:0] : 0;
+			data_.key.code = CODE_UNKNOWN;
 			repeats_ = [e isARepeat]? 1 : 0;
 		}
 		break;
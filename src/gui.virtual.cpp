@@ -0,0 +1,214 @@
+#include "oxygen/oxygen.hpp"
+#include "oxygen/keys.hpp"
+
+namespace aspect { namespace gui {
+
+// Generated letter keys with their PC set 1 scan codes
+static struct { key_code key; uint32_t scan_code; } const letter_keys[26] =
+{
+	{ KEY_A, 0x1E }, { KEY_B, 0x30 }, { KEY_C, 0x2E }, { KEY_D, 0x20 }, { KEY_E, 0x12 },
+	{ KEY_F, 0x21 }, { KEY_G, 0x22 }, { KEY_H, 0x23 }, { KEY_I, 0x17 }, { KEY_J, 0x24 },
+	{ KEY_K, 0x25 }, { KEY_L, 0x26 }, { KEY_M, 0x32 }, { KEY_N, 0x31 }, { KEY_O, 0x18 },
+	{ KEY_P, 0x19 }, { KEY_Q, 0x10 }, { KEY_R, 0x13 }, { KEY_S, 0x1F }, { KEY_T, 0x14 },
+	{ KEY_U, 0x16 }, { KEY_V, 0x2F }, { KEY_W, 0x11 }, { KEY_X, 0x2D }, { KEY_Y, 0x15 },
+	{ KEY_Z, 0x2C },
+};
+
+// Scan code in the form delivered by the native window of the platform
+static uint32_t native_scan_code(key_code key, uint32_t scan_code)
+{
+#if OS(WINDOWS)
+	// LPARAM with the scan code in bits 16..23 and the repeat count 1
+	(void)key;
+	return (scan_code << 16) | 1;
+#elif OS(DARWIN)
+	// virtual key codes are hardware key codes
+	(void)scan_code;
+	return key;
+#else
+	// evdev key codes are offset by 8
+	(void)key;
+	return scan_code + 8;
+#endif
+}
+
+virtual_window::virtual_window(v8::FunctionCallbackInfo<v8::Value> const& args)
+	: window_base(runtime::instance(args.GetIsolate()))
+	, destroyed_(false)
+	, generated_(0)
+{
+	set_js_class<virtual_window>();
+
+	v8::Isolate* isolate = args.GetIsolate();
+	v8::HandleScope scope(isolate);
+
+	v8::Local<v8::Object> options = args[0]->IsObject()? args[0]->ToObject() : v8::Object::New(isolate);
+	get_option(isolate, options, "width", size_.width = 800);
+	get_option(isolate, options, "height", size_.height = 600);
+	get_option(isolate, options, "reuseEvents", reuse_events_);
+}
+
+void virtual_window::destroy()
+{
+	if (destroyed_)
+	{
+		return;
+	}
+	destroyed_ = true;
+
+	stop_generator();
+	stop_replay();
+}
+
+void virtual_window::inject(input_event const& e)
+{
+	on_input(e);
+}
+
+void virtual_window::resize(int width, int height)
+{
+	if (width < 0 || height < 0)
+	{
+		throw std::invalid_argument("negative window size");
+	}
+	box<int> new_size(width, height);
+	{
+		boost::mutex::scoped_lock lock(size_mutex_);
+		size_ = new_size;
+	}
+	on_resize(new_size);
+}
+
+// Event types produced by make_event()
+static bool is_generated(input_event::event_type type)
+{
+	switch (type)
+	{
+	case input_event::KEY_DOWN:
+	case input_event::KEY_UP:
+	case input_event::KEY_CHAR:
+	case input_event::MOUSE_MOVE:
+	case input_event::MOUSE_WHEEL:
+	case input_event::MOUSE_DOWN:
+	case input_event::MOUSE_UP:
+	case input_event::MOUSE_CLICK:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void virtual_window::generate(v8::FunctionCallbackInfo<v8::Value> const& args)
+{
+	v8::Isolate* isolate = args.GetIsolate();
+	v8::HandleScope scope(isolate);
+
+	std::string type_str = "mousemove";
+	double rate = 0;
+	double count = 0;
+
+	v8::Local<v8::Object> options = args[0]->IsObject()? args[0]->ToObject() : v8::Object::New(isolate);
+	get_option(isolate, options, "type", type_str);
+	get_option(isolate, options, "rate", rate);
+	get_option(isolate, options, "count", count);
+
+	input_event::event_type const type = input_event::type_from_str(type_str);
+	if (!is_generated(type))
+	{
+		throw std::invalid_argument("unsupported generator event type " + type_str);
+	}
+	if (rate < 0 || count < 0)
+	{
+		throw std::invalid_argument("negative generator rate or count");
+	}
+
+	stop_generator();
+	generated_ = 0;
+	generator_ = boost::thread(&virtual_window::run_generator, this, type, rate, static_cast<uint64_t>(count));
+}
+
+void virtual_window::stop_generator()
+{
+	generator_.interrupt();
+	generator_.join();
+}
+
+input_event virtual_window::make_event(input_event::event_type type, uint64_t n, box<int> const& size)
+{
+	// Walk the pointer along the window diagonal, alternate keys and buttons
+	int const x = size.width? static_cast<int>(n % size.width) : 0;
+	int const y = size.height? static_cast<int>(n % size.height) : 0;
+
+	switch (type)
+	{
+	case input_event::KEY_DOWN:
+	case input_event::KEY_UP:
+	case input_event::KEY_CHAR:
+		{
+			uint32_t const letter = n % 26;
+			key_code const key = letter_keys[letter].key;
+			return input_event::key(type, 0, key, native_scan_code(key, letter_keys[letter].scan_code), 'a' + letter);
+		}
+	case input_event::MOUSE_WHEEL:
+		return input_event::mouse(type, 0, 0, x, y, 0, (n & 1)? 120 : -120);
+	case input_event::MOUSE_DOWN:
+	case input_event::MOUSE_UP:
+	case input_event::MOUSE_CLICK:
+		return input_event::mouse(type, 1, 0, x, y);
+	default:
+		_aspect_assert(type == input_event::MOUSE_MOVE && "generated event type expected");
+		return input_event::mouse(input_event::MOUSE_MOVE, 0, 0, x, y, 1, 1);
+	}
+}
+
+void virtual_window::run_generator(input_event::event_type type, double rate, uint64_t count)
+{
+	using namespace boost::chrono;
+
+	steady_clock::time_point const start = steady_clock::now();
+	try
+	{
+		for (uint64_t n = 0; count == 0 || n < count; )
+		{
+			// Produce the events due by now in a batch, then sleep a millisecond
+			uint64_t due = n + 1024;
+			if (rate > 0)
+			{
+				double const elapsed = duration_cast<duration<double>>(steady_clock::now() - start).count();
+				due = static_cast<uint64_t>(elapsed * rate) + 1;
+			}
+			if (count)
+			{
+				due = std::min(due, count);
+			}
+
+			box<int> size;
+			{
+				boost::mutex::scoped_lock lock(size_mutex_);
+				size = size_;
+			}
+			for (; n < due; ++n)
+			{
+				on_input(make_event(type, n, size));
+				++generated_;
+			}
+
+			if (rate > 0)
+			{
+				boost::this_thread::sleep_for(milliseconds(1));
+			}
+			else
+			{
+				boost::this_thread::interruption_point();
+			}
+		}
+	}
+	catch (boost::thread_interrupted const&)
+	{
+		return;
+	}
+
+	on_event("generateend");
+}
+
+}} // aspect::gui
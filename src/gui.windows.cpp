@@ -1,5 +1,6 @@
 #include "oxygen/oxygen.hpp"
 #include "oxygen/gui.windows.hpp"
+#include "oxygen/keys.hpp"
 
 #include <boost/iostreams/device/mapped_file.hpp>
 
@@ -147,6 +148,7 @@ void window::init(creation_args const& args)
 void window::create(creation_args args)
 {
 	style_ = args.style;
+	reuse_events_ = args.reuse_events;
 
 	// Choose the window style according to the Style parameter
 	DWORD window_style = WS_CLIPCHILDREN;
@@ -220,6 +222,8 @@ void window::create(creation_args args)
 
 void window::destroy()
 {
+	stop_replay();
+
 	if (hwnd_)
 	{
 		if(fullscreen_)
@@ -335,7 +339,7 @@ bool window::process(event& e)
 		{
 			PostQuitMessage(0);
 		}
-		on_event("close");
+		on_event(CLOSE_EVENT);
 		break;
 
 	case WM_MOUSEMOVE:
@@ -646,6 +650,7 @@ void window::drag_accept_files(shared_wstrings files)
 
 input_event::input_event(event const& e)
 	: type_and_state_(UNKNOWN)
+	, region_(0)
 {
 	if (e.message >= WM_MOUSEFIRST && e.message <= WM_MOUSELAST)
 	{
@@ -672,6 +677,7 @@ input_event::input_event(event const& e)
 		data_.key.scan_code = static_cast<uint32_t>(e.lparam);
 		data_.key.key_code =  static_cast<uint32_t>(e.wparam);
 		data_.key.char_code = static_cast<uint32_t>(e.message == WM_CHAR? e.wparam : 0);
+		data_.key.code = CODE_UNKNOWN;
 		repeats_ = LOWORD(e.lparam);
 	}
 }
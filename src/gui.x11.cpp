@@ -1,24 +1,116 @@
 #include "oxygen/oxygen.hpp"
 #include "oxygen/gui.x11.hpp"
+#include "oxygen/keys.hpp"
 
 #include <X11/Xlib.h>
+#include <X11/Xatom.h>
 #include <X11/cursorfont.h>
 #include <X11/keysym.h>
 #include <X11/XKBlib.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/Xcursor/Xcursor.h>
+#include <X11/extensions/XInput2.h>
 
 #include <GL/glx.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+
 namespace aspect { namespace gui {
 
 Display* g_display = nullptr;
+Display* g_event_display = nullptr;
 int g_screen = 0;
 Window g_root = 0;
 XIM g_input_method = nullptr;
 randr_info randr;
 
+lock_stats g_display_lock_stats;
+lock_stats g_event_display_lock_stats;
+creation_stats g_creation_stats;
+resource_stats g_resource_stats;
+
 static XContext window_context;
 static boost::thread process_events_thread;
 static bool is_running = false;
+static int wake_pipe[2] = { -1, -1 };
+static int xkb_event_base = 0;
+static int xi_opcode = 0;
+
+// Window with the pointer locked, receives XInput2 raw motion events
+static boost::atomic<window*> pointer_lock_window(nullptr);
+
+// Keymap table, replaced as a whole on mapping change. The event thread and
+// JavaScript threads take a reference to read it, so a replaced table is freed
+// only after its last reader, even if the mapping changes again meanwhile
+struct keymap_table
+{
+	key_info keys[256];
+};
+
+typedef boost::shared_ptr<keymap_table const> keymap_table_ptr;
+static keymap_table_ptr current_keymap;
+
+// Atoms used by windows, interned at once on init
+enum atom_id
+{
+	ATOM_WM_DELETE_WINDOW,
+	ATOM_MOTIF_WM_HINTS,
+	ATOM_NET_WM_STATE,
+	ATOM_NET_WM_STATE_FULLSCREEN,
+	ATOM_NET_WM_BYPASS_COMPOSITOR,
+	ATOM_COUNT
+};
+
+static char const* const atom_names[ATOM_COUNT] =
+{
+	"WM_DELETE_WINDOW",
+	"_MOTIF_WM_HINTS",
+	"_NET_WM_STATE",
+	"_NET_WM_STATE_FULLSCREEN",
+	"_NET_WM_BYPASS_COMPOSITOR",
+};
+
+static Atom atoms[ATOM_COUNT];
+
+// Chosen visuals for graphics settings, shared by windows to avoid visual scan per window
+typedef std::tuple<unsigned, unsigned, unsigned, unsigned> visual_key;
+static std::map<visual_key, std::pair<XVisualInfo, graphics_settings>> visuals;
+static boost::mutex visuals_mutex;
+
+// X resources shared by windows and reference counted:
+// colormaps for visuals and cursors on g_display
+struct shared_colormap
+{
+	Colormap colormap;
+	unsigned refs;
+};
+
+static std::map<VisualID, shared_colormap> colormaps;
+static unsigned cursor_refs = 0;
+static Cursor hidden_cursor = 0;
+static Cursor stock_cursors[window::WAIT + 1];
+static boost::mutex resources_mutex;
+
+// Image cursors live until the connection is closed, cursor id is index + 1
+static std::vector<Cursor> image_cursors;
+static std::map<std::string, unsigned> image_cursor_names;
+
+// The first change in a main loop turn flushes g_display requests right away,
+// later ones are flushed once on the scheduled flush
+static boost::atomic<bool> flush_pending(false);
+static boost::atomic<bool> flush_deferred(false);
+
+// Refill of the window pool is scheduled once after windows have been taken from it
+static boost::atomic<bool> refill_pending(false);
+
+static void refill_window_pool();
+static void clear_window_pool();
+static void wake_event_thread();
+
+// Held while an event is processed by its window, to destroy the window in between
+static boost::recursive_mutex dispatch_mutex;
 
 /*
 static char const* event_names[] = {
@@ -30,25 +122,113 @@ static char const* event_names[] = {
 };
 */
 
+display_lock::display_lock(Display* display, lock_stats& stats)
+	: display_(display)
+	, lock_(stats.mutex, boost::try_to_lock)
+{
+	if (!lock_.owns_lock())
+	{
+		// Another thread owns the display
+		boost::chrono::steady_clock::time_point const start = boost::chrono::steady_clock::now();
+		lock_.lock();
+		boost::chrono::microseconds const wait = boost::chrono::duration_cast<boost::chrono::microseconds>(
+			boost::chrono::steady_clock::now() - start);
+
+		++stats.contended;
+		stats.wait_us += wait.count();
+	}
+	XLockDisplay(display_);
+	++stats.locks;
+}
+
+display_lock::display_lock(Display* display, lock_stats& stats, boost::try_to_lock_t)
+	: display_(display)
+	, lock_(stats.mutex, boost::try_to_lock)
+{
+	if (lock_.owns_lock())
+	{
+		XLockDisplay(display_);
+		++stats.locks;
+	}
+}
+
+display_lock::~display_lock()
+{
+	if (!lock_.owns_lock())
+	{
+		return;
+	}
+
+	// Round trips of other threads may read events into the queue
+	// while the event thread is waiting in select()
+	bool const events_queued = process_events_thread.get_id() != boost::this_thread::get_id()
+		&& XEventsQueued(display_, QueuedAlready) > 0;
+	XUnlockDisplay(display_);
+	lock_.unlock();
+
+	if (events_queued)
+	{
+		wake_event_thread();
+	}
+}
+
 static window* get_window(XEvent const& event)
 {
 	XPointer window_ptr = nullptr;
-	XFindContext(g_display, event.xany.window, window_context, &window_ptr);
+	XFindContext(g_event_display, event.xany.window, window_context, &window_ptr);
 	return reinterpret_cast<window*>(window_ptr);
 }
 
+// Wake up the event thread waiting in select(), i.e. after events
+// have been read into the event queue by another thread
+static void wake_event_thread()
+{
+	char const c = 0;
+	ssize_t const written = write(wake_pipe[1], &c, 1);
+	(void)written;
+}
+
 void window::init()
 {
 	XInitThreads();
 	g_display = XOpenDisplay(nullptr);
-	if (!g_display)
+	g_event_display = XOpenDisplay(nullptr);
+	if (!g_display || !g_event_display || pipe(wake_pipe) != 0)
 	{
 		throw std::runtime_error("Failed to open a connection with the X server");
 	}
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
 
 	g_screen = DefaultScreen(g_display);
 	g_root = RootWindow(g_display, g_screen);
-	g_input_method = XOpenIM(g_display, nullptr, nullptr, nullptr);
+	g_input_method = XOpenIM(g_event_display, nullptr, nullptr, nullptr);
+
+	// Atoms are global for the server, valid for both connections
+	if (!XInternAtoms(g_display, const_cast<char**>(atom_names), ATOM_COUNT, False, atoms))
+	{
+		throw std::runtime_error("Failed to intern X atoms");
+	}
+
+	int xkb_opcode, xkb_error_base, xkb_major = XkbMajorVersion, xkb_minor = XkbMinorVersion;
+	if (XkbQueryExtension(g_event_display, &xkb_opcode, &xkb_event_base, &xkb_error_base, &xkb_major, &xkb_minor))
+	{
+		unsigned const xkb_events = XkbNewKeyboardNotifyMask | XkbMapNotifyMask;
+		XkbSelectEvents(g_event_display, XkbUseCoreKbd, xkb_events, xkb_events);
+	}
+	else
+	{
+		xkb_event_base = 0;
+	}
+	update_keymap();
+
+	// XInput 2.0 raw events for the pointer lock
+	int xi_event_base, xi_error_base, xi_major = 2, xi_minor = 0;
+	if (!XQueryExtension(g_event_display, "XInputExtension", &xi_opcode, &xi_event_base, &xi_error_base)
+		|| XIQueryVersion(g_event_display, &xi_major, &xi_minor) != Success)
+	{
+		xi_opcode = 0;
+	}
 
 	randr.is_available = XRRQueryExtension(g_display, &randr.event_base, &randr.error_base)
 		&& XRRQueryVersion(g_display, &randr.version_major, &randr.version_minor);
@@ -66,63 +246,198 @@ void window::cleanup()
 {
 	is_running = false;
 
-	// Send dummy event to wake up thread
-	XClientMessageEvent dummy = {};
-	dummy.type = ClientMessage;
-	dummy.format = 8;
-	XSendEvent(g_display, 0, 0, 0, (XEvent*)&dummy);
-
+	wake_event_thread();
 	if (process_events_thread.joinable()) process_events_thread.join();
 
+	clear_window_pool();
+
+	// Shared resources are freed with the connection
+	visuals.clear();
+	colormaps.clear();
+	cursor_refs = 0;
+	hidden_cursor = 0;
+	std::fill(std::begin(stock_cursors), std::end(stock_cursors), 0);
+	image_cursors.clear();
+	image_cursor_names.clear();
+
 	if (g_input_method)
 	{
 		XCloseIM(g_input_method);
 		g_input_method = nullptr;
 	}
 
+	boost::atomic_store(&current_keymap, keymap_table_ptr());
+
 	g_screen = 0;
 	g_root = 0;
+	if (g_event_display)
+	{
+		XCloseDisplay(g_event_display);
+		g_event_display = nullptr;
+	}
 	if (g_display)
 	{
 		XCloseDisplay(g_display);
 		g_display = nullptr;
 	}
+
+	for (int& fd : wake_pipe)
+	{
+		if (fd >= 0) close(fd);
+		fd = -1;
+	}
 }
 
-void window::process_events()
+void window::dispatch(XEvent& event)
 {
-	os::set_thread_name("window::process_events");
-
-	int const fd = ConnectionNumber(g_display);
-	fd_set fds;
+	boost::recursive_mutex::scoped_lock lock(dispatch_mutex);
+	if (window* wnd = get_window(event))
+	{
+		wnd->process(event);
+	}
+}
 
-	while (is_running)
+void window::process_pending_events()
+{
+	for (;;)
 	{
-		for(int pending_events = XPending(g_display); pending_events > 0; --pending_events)
+		XEvent event;
+		bool is_raw_motion = false;
+		double delta[2] = {};
+
 		{
-			XEvent event;
-	
-			XNextEvent(g_display, &event);
+			// The lock is held only to read the event, windows process it unlocked
+			display_lock lock(g_event_display, g_event_display_lock_stats);
+			if (!XPending(g_event_display))
+			{
+				break;
+			}
+			XNextEvent(g_event_display, &event);
 //			trace("%s\n", event_names[event.type]);
 
-			if (window* wnd = get_window(event))
+			// Keyboard mapping changes are not bound to a window
+			if (event.type == MappingNotify)
+			{
+				XRefreshKeyboardMapping(&event.xmapping);
+				if (event.xmapping.request != MappingPointer)
+				{
+					update_keymap();
+				}
+				continue;
+			}
+			if (xkb_event_base && event.type == xkb_event_base)
+			{
+				XkbEvent& xkb_event = reinterpret_cast<XkbEvent&>(event);
+				if (xkb_event.any.xkb_type == XkbMapNotify)
+				{
+					XkbRefreshKeyboardMapping(&xkb_event.map);
+					update_keymap();
+				}
+				else if (xkb_event.any.xkb_type == XkbNewKeyboardNotify)
+				{
+					update_keymap();
+				}
+				continue;
+			}
+
+			// Raw motion is delivered to the root window for the pointer lock
+			if (xi_opcode && event.type == GenericEvent && event.xcookie.extension == xi_opcode)
+			{
+				if (XGetEventData(g_event_display, &event.xcookie))
+				{
+					if (event.xcookie.evtype == XI_RawMotion)
+					{
+						XIRawEvent const* raw = static_cast<XIRawEvent const*>(event.xcookie.data);
+						double const* values = raw->raw_values;
+						for (int i = 0; i < 2 && i < raw->valuators.mask_len * 8; ++i)
+						{
+							if (XIMaskIsSet(raw->valuators.mask, i))
+							{
+								delta[i] = *values++;
+							}
+						}
+						is_raw_motion = true;
+					}
+					XFreeEventData(g_event_display, &event.xcookie);
+				}
+				if (!is_raw_motion)
+				{
+					continue;
+				}
+			}
+		}
+
+		if (is_raw_motion)
+		{
+			boost::recursive_mutex::scoped_lock lock(dispatch_mutex);
+			if (window* wnd = pointer_lock_window)
+			{
+				wnd->process_raw_motion(delta[0], delta[1]);
+			}
+		}
+		else
+		{
+			dispatch(event);
+		}
+	}
+}
+
+void window::process_request_events()
+{
+	for (;;)
+	{
+		XEvent event;
+		{
+			// Don't wait for the JavaScript thread, it wakes up the event thread
+			// on unlock when events have been left in the queue
+			display_lock lock(g_display, g_display_lock_stats, boost::try_to_lock);
+			if (!lock.owns_lock() || !XPending(g_display))
 			{
-				wnd->process(event);
+				break;
 			}
+			XNextEvent(g_display, &event);
 		}
 
-		// Start waiting for a next event. XNextEvent blocks g_display so other threads can't use Xlib.
-		// Using select() for the display connection to wait for another XEvent
+		// Only messages sent to the window creator are expected on this connection
+		if (event.type == ClientMessage)
+		{
+			dispatch(event);
+		}
+	}
+}
+
+void window::process_events()
+{
+	os::set_thread_name("window::process_events");
+
+	int const fd = ConnectionNumber(g_event_display);
+	int const request_fd = ConnectionNumber(g_display);
+	int const wake_fd = wake_pipe[0];
+	fd_set fds;
+
+	while (is_running)
+	{
+		process_pending_events();
+		process_request_events();
+
+		// Start waiting for a next event. XNextEvent blocks g_event_display so other threads can't use it.
+		// Using select() for the display connections and the wake up pipe to wait for another XEvent
 		FD_ZERO(&fds);
 		FD_SET(fd, &fds);
-		select(fd + 1, &fds, NULL, NULL, NULL);
+		FD_SET(request_fd, &fds);
+		FD_SET(wake_fd, &fds);
+		if (select(std::max(std::max(fd, request_fd), wake_fd) + 1, &fds, NULL, NULL, NULL) > 0 && FD_ISSET(wake_fd, &fds))
+		{
+			char buf[64];
+			while (read(wake_fd, buf, sizeof(buf)) > 0) {}
+		}
 	}
 }
 
 static unsigned long const ms_event_mask  =
 	FocusChangeMask | ButtonPressMask | ButtonReleaseMask | ButtonMotionMask |
 	PointerMotionMask | KeyPressMask | KeyReleaseMask | StructureNotifyMask |
-	EnterWindowMask | LeaveWindowMask;
+	EnterWindowMask | LeaveWindowMask | PropertyChangeMask;
 
 static unsigned score_config(creation_args const& args, graphics_settings const& settings,
 	int color_bits, int depth_bits, int stencil_bits, int antialiasing_level)
@@ -241,6 +556,132 @@ static bool create_context(creation_args const& args, XVisualInfo& ChosenVisual,
 	return true;
 }
 
+static bool choose_visual(creation_args const& args, XVisualInfo& visual, graphics_settings& settings)
+{
+	boost::mutex::scoped_lock lock(visuals_mutex);
+
+	visual_key const key(args.bpp, settings.depth_bits, settings.stencil_bits, settings.antialiasing_level);
+	auto it = visuals.find(key);
+	if (it == visuals.end())
+	{
+		graphics_settings chosen_settings = settings;
+		if (!create_context(args, visual, chosen_settings))
+		{
+			return false;
+		}
+		it = visuals.emplace(key, std::make_pair(visual, chosen_settings)).first;
+	}
+	visual = it->second.first;
+	settings = it->second.second;
+	return true;
+}
+
+// Call under g_display lock
+static Colormap acquire_colormap(XVisualInfo const& visual)
+{
+	boost::mutex::scoped_lock lock(resources_mutex);
+
+	shared_colormap& entry = colormaps[visual.visualid];
+	if (entry.refs++ == 0)
+	{
+		entry.colormap = XCreateColormap(g_display, g_root, visual.visual, AllocNone);
+		++g_resource_stats.colormaps;
+	}
+	return entry.colormap;
+}
+
+// Call under g_display lock
+static void release_colormap(VisualID visual_id)
+{
+	boost::mutex::scoped_lock lock(resources_mutex);
+
+	auto it = colormaps.find(visual_id);
+	if (it != colormaps.end() && --it->second.refs == 0)
+	{
+		XFreeColormap(g_display, it->second.colormap);
+		colormaps.erase(it);
+		--g_resource_stats.colormaps;
+	}
+}
+
+static void acquire_cursors()
+{
+	boost::mutex::scoped_lock lock(resources_mutex);
+	++cursor_refs;
+}
+
+// Call under g_display lock
+static void release_cursors()
+{
+	boost::mutex::scoped_lock lock(resources_mutex);
+
+	if (cursor_refs && --cursor_refs == 0)
+	{
+		for (Cursor& cursor : stock_cursors)
+		{
+			if (cursor)
+			{
+				XFreeCursor(g_display, cursor);
+				cursor = 0;
+				--g_resource_stats.cursors;
+			}
+		}
+		if (hidden_cursor)
+		{
+			XFreeCursor(g_display, hidden_cursor);
+			hidden_cursor = 0;
+			--g_resource_stats.cursors;
+		}
+	}
+}
+
+// Call under g_display lock
+static Cursor get_hidden_cursor()
+{
+	boost::mutex::scoped_lock lock(resources_mutex);
+
+	if (!hidden_cursor)
+	{
+		// Create the cursor's pixmap (1x1 pixels)
+		Pixmap CursorPixmap = XCreatePixmap(g_display, g_root, 1, 1, 1);
+		GC GraphicsContext = XCreateGC(g_display, CursorPixmap, 0, nullptr);
+		XDrawPoint(g_display, CursorPixmap, GraphicsContext, 0, 0);
+		XFreeGC(g_display, GraphicsContext);
+
+		// Create the cursor, using the pixmap as both the shape and the mask of the cursor
+		XColor Color;
+		Color.flags = DoRed | DoGreen | DoBlue;
+		Color.red = Color.blue = Color.green = 0;
+		hidden_cursor = XCreatePixmapCursor(g_display, CursorPixmap, CursorPixmap, &Color, &Color, 0, 0);
+		++g_resource_stats.cursors;
+
+		// We don't need the pixmap any longer, free it
+		XFreePixmap(g_display, CursorPixmap);
+	}
+	return hidden_cursor;
+}
+
+// Call under g_display lock
+static Cursor get_stock_cursor(window::cursor_id id, unsigned shape)
+{
+	boost::mutex::scoped_lock lock(resources_mutex);
+
+	Cursor& cursor = stock_cursors[id];
+	if (!cursor)
+	{
+		cursor = XCreateFontCursor(g_display, shape);
+		++g_resource_stats.cursors;
+	}
+	return cursor;
+}
+
+static unsigned add_image_cursor(Cursor cursor)
+{
+	image_cursors.push_back(cursor);
+	++g_resource_stats.cursors;
+	return static_cast<unsigned>(image_cursors.size());
+}
+
 /*
 bool create_pbuffer(XVisualInfo *visual_info)
 {
@@ -293,75 +734,63 @@ window::window(v8::FunctionCallbackInfo<v8::Value> const& args)
 	: window_base(runtime::instance(args.GetIsolate()))
 	, window_(0)
 	, atom_close_(0)
-	, previous_video_mode_(-1)
-	, hidden_cursor_(0)
-	, current_cursor_(0)
+	, cursor_(None)
+	, fullscreen_(false)
+	, wm_state_changed_(false)
+	, mode_changed_(false)
+	, parent_(0)
+	, parent_x_(0)
+	, parent_y_(0)
+	, pointer_x_(0)
+	, pointer_y_(0)
+	, modifiers_(0)
+	, raw_dx_(0)
+	, raw_dy_(0)
 	, capture_count_(0)
+	, press_button_(0)
+	, press_x_(0)
+	, press_y_(0)
+	, press_count_(0)
+	, dragging_(false)
+	, click_button_(0)
+	, click_x_(0)
+	, click_y_(0)
+	, click_time_(0)
+	, click_count_(0)
 	, input_context_(nullptr)
+	, create_time_(boost::chrono::steady_clock::now())
+	, mapped_(false)
 {
 	create(creation_args(args));
 }
 
-void window::create(creation_args const& args)
+// Create a window with attributes and window manager hints for the style
+// Window events are selected on g_event_display in window::_init()
+// Call under g_display lock
+static Window create_x_window(XVisualInfo const& visual, unsigned style, int left, int top, int width, int height)
 {
-	style_ = args.style;
-	if (style_ & GWS_APPWINDOW)
-		style_ |= GWS_TITLEBAR | GWS_RESIZE | GWS_CLOSE;
-
-	bool const fullscreen = (style_ & GWS_FULLSCREEN) != 0;
-
-	// Compute position and size
-	int const width = size_.width = args.width;
-	int const height = size_.height = args.height;
-
-	int const left = fullscreen? 0 : args.left;
-	int const top = fullscreen? 0 : args.top;
-
-	// Switch to fullscreen if necessary
-	if (fullscreen)
-	{
-		switch_to_fullscreen(display::mode(args.width, args.height, args.bpp, 0));
-	}
-
-	// Create the rendering context
-	gui::graphics_settings settings;
-	if (!create_context(args, current_visual_, settings))
-	{
-		return;
-	}
-
-	// Create a new color map with the chosen visual
-	Colormap ColMap = XCreateColormap(g_display, g_root, current_visual_.visual, AllocNone);
-
 	// Define the window attributes
 	XSetWindowAttributes Attributes;
-	Attributes.event_mask        = ms_event_mask;
-	Attributes.colormap          = ColMap;
-	Attributes.override_redirect = fullscreen;
+	Attributes.colormap          = acquire_colormap(visual);
 
 	// Create the window
-	window_ = XCreateWindow(g_display, g_root,
+	Window result = XCreateWindow(g_display, g_root,
 		left, top,
 		width, height,
 		0,
-		current_visual_.depth,
+		visual.depth,
 		InputOutput,
-		current_visual_.visual,
-		CWEventMask | CWColormap | CWOverrideRedirect, &Attributes);
-	if (!window_)
+		visual.visual,
+		CWColormap, &Attributes);
+	if (!result)
 	{
-		throw std::runtime_error("Failed to create window");
+		return 0;
 	}
-	XSaveContext(g_display, window_, window_context, reinterpret_cast<XPointer>(this));
-
-
-	// Set the window's name
-	XStoreName(g_display, window_, args.caption.c_str());
 
 	// Set the window's style (tell the windows manager to change our window's decorations and functions according to the requested style)
-	if (!fullscreen)
+	// Fullscreen windows have them too, to be used after leaving fullscreen
 	{
-		Atom WMHintsAtom = XInternAtom(g_display, "_MOTIF_WM_HINTS", false);
+		Atom const WMHintsAtom = atoms[ATOM_MOTIF_WM_HINTS];
 		if (WMHintsAtom)
 		{
 			static const unsigned long MWM_HINTS_FUNCTIONS   = 1 << 0;
@@ -397,156 +826,376 @@ void window::create(creation_args const& args)
 			Hints.Functions   = 0;
 
 
-			if (style_ & GWS_TITLEBAR)
+			if (style & GWS_TITLEBAR)
 			{
 				Hints.Decorations |= MWM_DECOR_BORDER | MWM_DECOR_TITLE | MWM_DECOR_MINIMIZE | MWM_DECOR_MENU;
 				Hints.Functions   |= MWM_FUNC_MOVE | MWM_FUNC_MINIMIZE;
 			}
-			if (style_ & GWS_RESIZE)
+			if (style & GWS_RESIZE)
 			{
 				Hints.Decorations |= MWM_DECOR_MAXIMIZE | MWM_DECOR_RESIZEH;
 				Hints.Functions   |= MWM_FUNC_MAXIMIZE | MWM_FUNC_RESIZE;
 			}
 
-			if (style_ & GWS_CLOSE)
+			if (style & GWS_CLOSE)
 			{
 				Hints.Decorations |= 0;
 				Hints.Functions   |= MWM_FUNC_CLOSE;
 			}
 
 			const unsigned char* HintsPtr = reinterpret_cast<const unsigned char*>(&Hints);
-			XChangeProperty(g_display, window_, WMHintsAtom, WMHintsAtom, 32, PropModeReplace, HintsPtr, 5);
+			XChangeProperty(g_display, result, WMHintsAtom, WMHintsAtom, 32, PropModeReplace, HintsPtr, 5);
 		}
 
 		// This is a hack to force some windows managers to disable resizing
 #if 0 // TODO!
-		if (!(style_ & GWS_RESIZE))
+		if (!(style & GWS_RESIZE))
 		{
 			XSizeHints XSizeHints;
 			XSizeHints.flags      = PMinSize | PMaxSize;
 			XSizeHints.min_width  = XSizeHints.max_width  = width;
 			XSizeHints.min_height = XSizeHints.max_height = height;
-			XSetWMNormalHints(g_display, window_, &XSizeHints); 
+			XSetWMNormalHints(g_display, result, &XSizeHints); 
 		}
 #endif
 	}
 
-	// Do some common initializations
-	_init();
+	// Set the atom defining the close event
+	XSetWMProtocols(g_display, result, &atoms[ATOM_WM_DELETE_WINDOW], 1);
 
-	// In fullscreen mode, we must grab keyboard and mouse inputs
-	if (fullscreen)
+	return result;
+}
+
+// Ask compositor to unredirect the window, to avoid extra frame latency in fullscreen
+static void set_bypass_compositor(Display* display, Window window, bool bypass)
+{
+	if (bypass)
 	{
-		capture_count_ = 1;
-		XGrabPointer(g_display, window_, true, 0, GrabModeAsync, GrabModeAsync, window_, None, CurrentTime);
-		XGrabKeyboard(g_display, window_, true, GrabModeAsync, GrabModeAsync, CurrentTime);
+		long const value = 1;
+		XChangeProperty(display, window, atoms[ATOM_NET_WM_BYPASS_COMPOSITOR], XA_CARDINAL, 32, PropModeReplace,
+			reinterpret_cast<unsigned char const*>(&value), 1);
+	}
+	else
+	{
+		XDeleteProperty(display, window, atoms[ATOM_NET_WM_BYPASS_COMPOSITOR]);
 	}
 }
 
-void window::_init()
+// Created on the first focus in the event thread
+static XIC create_input_context(Window window)
 {
-	// Make sure the "last key release" is initialized with invalid values
-//	myLastKeyReleaseEvent.type = -1;
-
-	// Get the atom defining the close event
-	atom_close_ = XInternAtom(g_display, "WM_DELETE_WINDOW", false);
-	XSetWMProtocols(g_display, window_, &atom_close_, 1);
-
-	// Create the input context
+	XIC result = nullptr;
 	if (g_input_method)
 	{
-		input_context_ = XCreateIC(g_input_method,
-			XNClientWindow,  window_,
-			XNFocusWindow,   window_,
+		result = XCreateIC(g_input_method,
+			XNClientWindow,  window,
+			XNFocusWindow,   window,
 			XNInputStyle,    XIMPreeditNothing  | XIMStatusNothing,
 			nullptr);
 
-		if (!input_context_)
+		if (!result)
 			std::cerr << "Failed to create input context for window -- TextEntered event won't be able to return unicode" << std::endl;
+		else
+			++g_resource_stats.input_contexts;
 	}
+	return result;
+}
 
-	// Show the window
-	XMapWindow(g_display, window_);
-	XFlush(g_display);
-
-	// Create the hiden cursor
-	create_hidden_cursor();
+// Pool of created, but not mapped windows for a window shape.
+// The pool is refilled in the JavaScript thread, on a main loop turn
+// after a window has been taken, to keep the event thread for input.
+struct window_pool_entry
+{
+	XVisualInfo visual;
+	unsigned style;
+	size_t size;
+	std::deque<Window> windows;
+};
 
-	// Set our context as the current OpenGL context for rendering
-//	SetActive();
+// Creation arguments a window is created with before it is mapped: the style without
+// the state flags, the requested pixel format and the visual chosen for it.
+// Position, size, caption, fullscreen state and display mode are applied when a pooled
+// window is taken, the input context is created on the first FocusIn for all windows
+typedef std::tuple<unsigned, visual_key, VisualID> window_pool_key;
+static std::map<window_pool_key, window_pool_entry> window_pool;
+static boost::mutex window_pool_mutex;
 
-	// Flush the commands queue
-	XFlush(g_display);
+static unsigned effective_style(unsigned style)
+{
+	if (style & GWS_APPWINDOW)
+		style |= GWS_TITLEBAR | GWS_RESIZE | GWS_CLOSE;
+	return style & ~(GWS_HIDDEN | GWS_FULLSCREEN);
 }
 
-void window::create_hidden_cursor()
+static window_pool_key pool_key(creation_args const& args, graphics_settings const& settings, XVisualInfo const& visual)
 {
-	// Create the cursor's pixmap (1x1 pixels)
-	Pixmap CursorPixmap = XCreatePixmap(g_display, window_, 1, 1, 1);
-	GC GraphicsContext = XCreateGC(g_display, CursorPixmap, 0, nullptr);
-	XDrawPoint(g_display, CursorPixmap, GraphicsContext, 0, 0);
-	XFreeGC(g_display, GraphicsContext);
+	return window_pool_key(effective_style(args.style),
+		visual_key(args.bpp, settings.depth_bits, settings.stencil_bits, settings.antialiasing_level),
+		visual.visualid);
+}
 
-	// Create the cursor, using the pixmap as both the shape and the mask of the cursor
-	XColor Color;
-	Color.flags = DoRed | DoGreen | DoBlue;
-	Color.red = Color.blue = Color.green = 0;
-	hidden_cursor_ = XCreatePixmapCursor(g_display, CursorPixmap, CursorPixmap, &Color, &Color, 0, 0);
+// Call under g_display lock
+static Window take_pooled_window(window_pool_key const& key)
+{
+	boost::mutex::scoped_lock lock(window_pool_mutex);
 
-	// We don't need the pixmap any longer, free it
-	XFreePixmap(g_display, CursorPixmap);
+	auto it = window_pool.find(key);
+	if (it == window_pool.end() || it->second.windows.empty())
+	{
+		return 0;
+	}
+	Window const result = it->second.windows.front();
+	it->second.windows.pop_front();
+	return result;
 }
 
-bool window::switch_to_fullscreen(display::mode const& mode)
+// Create missing windows in the pool, called in the JavaScript thread
+static void refill_window_pool()
 {
-	bool result = false;
+	refill_pending = false;
+	if (!g_display)
+	{
+		return;
+	}
 
-	// Check if the XRandR extension is present
-	int Version;
-	if (XQueryExtension(g_display, "RANDR", &Version, &Version, &Version))
+	display_lock lock(g_display, g_display_lock_stats);
+	boost::mutex::scoped_lock pool_lock(window_pool_mutex);
+
+	bool created = false;
+	for (auto& item : window_pool)
 	{
-		// Get the current configuration
-		XRRScreenConfiguration* Config = XRRGetScreenInfo(g_display, g_root);
-		if (Config)
+		window_pool_entry& entry = item.second;
+		while (entry.windows.size() < entry.size)
 		{
-			// Get the available screen sizes
-			int NbSizes;
-			XRRScreenSize* Sizes = XRRConfigSizes(Config, &NbSizes);
-			if (Sizes && NbSizes > 0)
+			Window const pooled = create_x_window(entry.visual, entry.style, 0, 0, 1, 1);
+			if (!pooled)
 			{
-				// Search a matching size
-				for (int i = 0; i < NbSizes; ++i)
-				{
-					if (Sizes[i].width == mode.width && Sizes[i].height == mode.height)
-					{
-						// Get the current rotation
-						Rotation current_rotation;
-						previous_video_mode_ = XRRConfigCurrentConfiguration(Config, &current_rotation);
-
-						// Switch to fullscreen mode
-						XRRSetScreenConfig(g_display, Config, g_root, i, current_rotation, CurrentTime);
-						result = true;
-						break;
-					}
-				}
+				break;
 			}
+			entry.windows.push_back(pooled);
+			created = true;
+		}
+	}
+
+	// Pooled windows should exist for the event selection on g_event_display
+	if (created)
+	{
+		XSync(g_display, False);
+	}
+}
+
+static void clear_window_pool()
+{
+	boost::mutex::scoped_lock lock(window_pool_mutex);
+
+	// Windows are destroyed with the connection
+	window_pool.clear();
+}
+
+void window::reserve(creation_args const& args, size_t count)
+{
+	unsigned const style = effective_style(args.style);
+
+	// Same requested settings as in window::create()
+	graphics_settings const requested;
+	graphics_settings settings = requested;
+	XVisualInfo visual;
+	if (!choose_visual(args, visual, settings))
+	{
+		throw std::runtime_error("Failed to choose window visual");
+	}
+
+	{
+		// Same lock order as in refill_window_pool()
+		display_lock lock(g_display, g_display_lock_stats);
+		boost::mutex::scoped_lock pool_lock(window_pool_mutex);
+
+		window_pool_entry& entry = window_pool[pool_key(args, requested, visual)];
+		entry.visual = visual;
+		entry.style = style;
+		entry.size = count;
+		while (entry.windows.size() > count)
+		{
+			XDestroyWindow(g_display, entry.windows.back());
+			release_colormap(visual.visualid);
+			entry.windows.pop_back();
+		}
+		XFlush(g_display);
+	}
+
+	refill_window_pool();
+}
 
-			// Free the configuration instance
-			XRRFreeScreenConfigInfo(Config);
+void window::create(creation_args const& args)
+{
+	style_ = args.style;
+	reuse_events_ = args.reuse_events;
+	if (style_ & GWS_APPWINDOW)
+		style_ |= GWS_TITLEBAR | GWS_RESIZE | GWS_CLOSE;
+
+	// Window manager makes the window fullscreen on the output it is placed
+	fullscreen_ = (style_ & GWS_FULLSCREEN) != 0;
+
+	// Compute position and size
+	int const width = size_.width = args.width;
+	int const height = size_.height = args.height;
+
+	int left = args.left;
+	int top = args.top;
+	parent_ = g_root;
+
+	// Change the display mode if the fullscreen window dimensions differ from it
+	if (fullscreen_)
+	{
+		// The window doesn't exist yet, use the requested display or the one under the window rectangle
+		mode_display_ = args.disp.name.empty()? display::from_rect(rectangle<int>(left, top, width, height)) : args.disp;
+		display::mode const curr_mode = mode_display_.current_mode();
+		if (curr_mode.width != static_cast<unsigned>(width) || curr_mode.height != static_cast<unsigned>(height))
+		{
+			mode_changed_ = mode_display_.set_mode(display::mode(width, height, curr_mode.bpp, args.frequency));
+			if (!mode_changed_)
+			{
+				std::cerr << "Failed to set display mode " << width << 'x' << height << " for fullscreen window" << std::endl;
+			}
+		}
+		left = mode_display_.rect.left;
+		top = mode_display_.rect.top;
+	}
+
+	// Create the rendering context
+	gui::graphics_settings const requested;
+	gui::graphics_settings settings = requested;
+	if (!choose_visual(args, current_visual_, settings))
+	{
+		return;
+	}
+
+	{
+		// The window is created and configured on the request connection,
+		// the event thread lock is taken only to select its events
+		display_lock lock(g_display, g_display_lock_stats);
+
+		// Take a window from the pool or create a new one
+		window_ = take_pooled_window(pool_key(args, requested, current_visual_));
+		bool const is_pooled = (window_ != 0);
+		if (is_pooled)
+		{
+			XMoveResizeWindow(g_display, window_, left, top, width, height);
+			if (!refill_pending.exchange(true))
+			{
+				rt_.main_loop().schedule(&refill_window_pool);
+			}
 		}
 		else
 		{
-			// Failed to get the screen configuration
-			std::cerr << "Failed to get the current screen configuration for fullscreen mode, switching to window mode" << std::endl;
+			window_ = create_x_window(current_visual_, style_, left, top, width, height);
+			if (!window_)
+			{
+				throw std::runtime_error("Failed to create window");
+			}
+		}
+		acquire_cursors();
+		++g_resource_stats.windows;
+		rect_ = rectangle<int>(left, top, width, height);
+
+		// Set the window's name
+		XStoreName(g_display, window_, args.caption.c_str());
+
+		// Initial window state is set with properties before mapping
+		if (fullscreen_)
+		{
+			XChangeProperty(g_display, window_, atoms[ATOM_NET_WM_STATE], XA_ATOM, 32, PropModeReplace,
+				reinterpret_cast<unsigned char const*>(&atoms[ATOM_NET_WM_STATE_FULLSCREEN]), 1);
+			set_bypass_compositor(g_display, window_, true);
+		}
+
+		// The window should exist for the event selection on g_event_display,
+		// this is the only flush of the window creation requests
+		if (is_pooled)
+		{
+			XFlush(g_display);
+		}
+		else
+		{
+			XSync(g_display, False);
 		}
 	}
-	else
+
+	// Do some common initializations
+	_init();
+}
+
+void window::set_fullscreen(bool fullscreen)
+{
+	display_lock lock(g_display, g_display_lock_stats);
+
+	fullscreen_ = fullscreen;
+	set_bypass_compositor(g_display, window_, fullscreen);
+
+	// Request the window manager to change the state of the mapped window, see EWMH _NET_WM_STATE
+	XEvent event = XEvent();
+	event.xclient.type = ClientMessage;
+	event.xclient.window = window_;
+	event.xclient.message_type = atoms[ATOM_NET_WM_STATE];
+	event.xclient.format = 32;
+	event.xclient.data.l[0] = fullscreen? 1 : 0; // _NET_WM_STATE_ADD : _NET_WM_STATE_REMOVE
+	event.xclient.data.l[1] = atoms[ATOM_NET_WM_STATE_FULLSCREEN];
+	event.xclient.data.l[2] = 0;
+	event.xclient.data.l[3] = 1; // normal application source
+	XSendEvent(g_display, g_root, False, SubstructureRedirectMask | SubstructureNotifyMask, &event);
+	XFlush(g_display);
+}
+
+bool window::is_fullscreen() const
+{
+	// The property is read on demand, without a round trip in the event thread
+	if (wm_state_changed_.exchange(false))
 	{
-		// XRandr extension is not supported : we cannot use fullscreen mode
-		std::cerr << "Fullscreen is not supported, switching to window mode" << std::endl;
+		display_lock lock(g_display, g_display_lock_stats);
+
+		Atom type;
+		int format;
+		unsigned long count, remaining;
+		unsigned char* data = nullptr;
+		if (XGetWindowProperty(g_display, window_, atoms[ATOM_NET_WM_STATE], 0, 32, False, XA_ATOM,
+			&type, &format, &count, &remaining, &data) == Success)
+		{
+			Atom const* states = reinterpret_cast<Atom const*>(data);
+			fullscreen_ = data && std::find(states, states + count, atoms[ATOM_NET_WM_STATE_FULLSCREEN]) != states + count;
+			if (data)
+			{
+				XFree(data);
+			}
+		}
 	}
+	return fullscreen_;
+}
 
-	return result;
+void window::toggle_fullscreen()
+{
+	set_fullscreen(!is_fullscreen());
+}
+
+void window::_init()
+{
+	// Make sure the "last key release" is initialized with invalid values
+//	myLastKeyReleaseEvent.type = -1;
+
+	// Get the atom defining the close event
+	atom_close_ = atoms[ATOM_WM_DELETE_WINDOW];
+
+	{
+		// Select the window events on the event connection. The window is mapped
+		// after the selection on the same connection, to receive its first events
+		display_lock lock(g_event_display, g_event_display_lock_stats);
+		XSaveContext(g_event_display, window_, window_context, reinterpret_cast<XPointer>(this));
+		XSelectInput(g_event_display, window_, ms_event_mask);
+		XMapWindow(g_event_display, window_);
+		XFlush(g_event_display);
+	}
+
+	// Set our context as the current OpenGL context for rendering
+//	SetActive();
 }
 
 void window::destroy()
@@ -556,21 +1205,38 @@ void window::destroy()
 		return;
 	}
 
+	// Wait for the event being processed by the window
+	boost::recursive_mutex::scoped_lock dispatch_lock(dispatch_mutex);
+
+	stop_replay();
+
 	// Cleanup graphical resources
 	_cleanup();
-	XDeleteContext(g_display, window_, window_context);	
 
-	// Destroy the input context
-	if (input_context_)
 	{
-		XDestroyIC(input_context_);
-		input_context_ = nullptr;
+		display_lock lock(g_event_display, g_event_display_lock_stats);
+		XDeleteContext(g_event_display, window_, window_context);
+
+		// Destroy the input context
+		if (input_context_)
+		{
+			XDestroyIC(input_context_);
+			input_context_ = nullptr;
+			--g_resource_stats.input_contexts;
+		}
+
+		// Requests for the window on the event connection should be done before it is destroyed
+		XSync(g_event_display, False);
 	}
 
-	// Destroy the window
+	// Destroy the window before its colormap and cursors
+	display_lock lock(g_display, g_display_lock_stats);
 	XDestroyWindow(g_display, window_);
+	release_colormap(current_visual_.visualid);
+	release_cursors();
 	XFlush(g_display);
 	window_ = 0;
+	--g_resource_stats.windows;
 
 	if (style_ & GWS_APPWINDOW)
 	{
@@ -580,26 +1246,13 @@ void window::destroy()
 
 void window::_cleanup()
 {
-	// Restore the previous video mode (in case we were running in fullscreen)
-	if (previous_video_mode_ >= 0)
-	{
-		// Get current screen info
-		XRRScreenConfiguration* Config = XRRGetScreenInfo(g_display, g_root);
-		if (Config)
-		{
-			// Get the current rotation
-			Rotation current_rotation;
-			XRRConfigCurrentConfiguration(Config, &current_rotation);
-
-			// Reset the video mode
-			XRRSetScreenConfig(g_display, Config, g_root, previous_video_mode_, current_rotation, CurrentTime);
+	unlock_pointer();
 
-			// Free the configuration instance
-			XRRFreeScreenConfigInfo(Config);
-		} 
-
-		// Reset the fullscreen window
-		previous_video_mode_ = -1;
+	// Restore the display mode changed for fullscreen
+	if (mode_changed_)
+	{
+		mode_display_.restore_mode();
+		mode_changed_ = false;
 	}
 
 	// Unhide the mouse cursor (in case it was hidden)
@@ -615,8 +1268,107 @@ void window::_cleanup()
 
 void window::show_mouse_cursor(bool show)
 {
-	XDefineCursor(g_display, window_, show? None : hidden_cursor_);
-	XFlush(g_display);
+	display_lock lock(g_display, g_display_lock_stats);
+	XDefineCursor(g_display, window_, show? cursor_ : get_hidden_cursor());
+	schedule_flush();
+}
+
+void window::schedule_flush()
+{
+	if (!flush_pending.exchange(true))
+	{
+		{
+			display_lock lock(g_display, g_display_lock_stats);
+			XFlush(g_display);
+		}
+		rt_.main_loop().schedule(&window::flush);
+	}
+	else
+	{
+		flush_deferred = true;
+	}
+}
+
+void window::flush()
+{
+	flush_pending = false;
+	if (flush_deferred.exchange(false) && g_display)
+	{
+		display_lock lock(g_display, g_display_lock_stats);
+		XFlush(g_display);
+	}
+}
+
+unsigned window::load_cursor(std::string const& name)
+{
+	display_lock lock(g_display, g_display_lock_stats);
+	boost::mutex::scoped_lock resources_lock(resources_mutex);
+
+	unsigned& id = image_cursor_names[name];
+	if (!id)
+	{
+		// Names with a path separator are Xcursor files, others are from the cursor theme
+		Cursor const cursor = (name.find('/') != name.npos)?
+			XcursorFilenameLoadCursor(g_display, name.c_str())
+			: XcursorLibraryLoadCursor(g_display, name.c_str());
+		if (!cursor)
+		{
+			image_cursor_names.erase(name);
+			throw std::runtime_error("Failed to load cursor " + name);
+		}
+		id = add_image_cursor(cursor);
+	}
+	return id;
+}
+
+unsigned window::create_cursor(unsigned width, unsigned height, int hot_x, int hot_y,
+	uint32_t const* pixels, size_t pixel_count)
+{
+	// Xcursor limits image dimensions, so width * height doesn't overflow
+	static unsigned const max_size = 0x7fff;
+	if (width == 0 || height == 0 || width > max_size || height > max_size)
+	{
+		throw std::invalid_argument("Invalid cursor size");
+	}
+	size_t const size = static_cast<size_t>(width) * height;
+	if (size > pixel_count)
+	{
+		throw std::invalid_argument("Cursor pixels are less than width * height");
+	}
+
+	display_lock lock(g_display, g_display_lock_stats);
+	boost::mutex::scoped_lock resources_lock(resources_mutex);
+
+	XcursorImage* image = XcursorImageCreate(width, height);
+	if (!image)
+	{
+		throw std::runtime_error("Failed to create cursor image");
+	}
+	image->xhot = hot_x;
+	image->yhot = hot_y;
+	std::copy(pixels, pixels + size, image->pixels);
+	Cursor const cursor = XcursorImageLoadCursor(g_display, image);
+	XcursorImageDestroy(image);
+	if (!cursor)
+	{
+		throw std::runtime_error("Failed to create cursor");
+	}
+	return add_image_cursor(cursor);
+}
+
+void window::set_image_cursor(unsigned id)
+{
+	display_lock lock(g_display, g_display_lock_stats);
+	{
+		boost::mutex::scoped_lock resources_lock(resources_mutex);
+		if (id == 0 || id > image_cursors.size())
+		{
+			throw std::invalid_argument("Invalid cursor id");
+		}
+		cursor_ = image_cursors[id - 1];
+	}
+	XDefineCursor(g_display, window_, cursor_);
+	schedule_flush();
 }
 
 void window::set_stock_cursor(cursor_id id)
@@ -646,17 +1398,15 @@ void window::set_stock_cursor(cursor_id id)
 		return;
 	}
 
-	if (current_cursor_)
-	{
-		XFreeCursor(g_display, current_cursor_);
-	}
-	current_cursor_ = XCreateFontCursor(g_display, shape);
-	XDefineCursor(g_display, window_, current_cursor_);
-	XFlush(g_display);
+	display_lock lock(g_display, g_display_lock_stats);
+	cursor_ = get_stock_cursor(id, shape);
+	XDefineCursor(g_display, window_, cursor_);
+	schedule_flush();
 }
 
 void window::capture_mouse(bool capture)
 {
+	display_lock lock(g_display, g_display_lock_stats);
 	if (capture)
 	{
 		if (++capture_count_ == 1) XGrabPointer(g_display, window_, true, 0, GrabModeAsync, GrabModeAsync, window_, None, CurrentTime);
@@ -665,39 +1415,227 @@ void window::capture_mouse(bool capture)
 	{
 		if (--capture_count_ == 0) XUngrabPointer(g_display, CurrentTime);
 	}
+	XFlush(g_display);
 }
 
 void window::set_mouse_pos(int x, int y)
 {
+	display_lock lock(g_display, g_display_lock_stats);
 	XWarpPointer(g_display, None, window_, 0, 0, 0, 0, x, y);
+	XFlush(g_display);
+}
+
+static void select_raw_motion(bool select)
+{
+	unsigned char bits[XIMaskLen(XI_RawMotion)] = {};
+	if (select)
+	{
+		XISetMask(bits, XI_RawMotion);
+	}
+	XIEventMask mask;
+	mask.deviceid = XIAllMasterDevices;
+	mask.mask_len = sizeof(bits);
+	mask.mask = bits;
+	XISelectEvents(g_event_display, g_root, &mask, 1);
+}
+
+bool window::lock_pointer()
+{
+	if (!xi_opcode)
+	{
+		return false;
+	}
+
+	Cursor cursor;
+	{
+		// The hidden cursor should exist on the server for the grab on g_event_display
+		display_lock lock(g_display, g_display_lock_stats);
+		cursor = get_hidden_cursor();
+		XSync(g_display, False);
+	}
+
+	// Grab on the event connection to keep receiving button events for the window
+	display_lock lock(g_event_display, g_event_display_lock_stats);
+	window* const locked = pointer_lock_window;
+	if (locked == this)
+	{
+		return true;
+	}
+
+	int const status = XGrabPointer(g_event_display, window_, True,
+		ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
+		GrabModeAsync, GrabModeAsync, window_, cursor, CurrentTime);
+	if (status != GrabSuccess)
+	{
+		return false;
+	}
+
+	raw_dx_ = raw_dy_ = 0;
+	pointer_lock_window = this;
+	if (!locked)
+	{
+		select_raw_motion(true);
+	}
+	XFlush(g_event_display);
+
+	// Events may have been read into the queue during the grab round trip
+	wake_event_thread();
+	return true;
+}
+
+void window::unlock_pointer()
+{
+	display_lock lock(g_event_display, g_event_display_lock_stats);
+
+	window* self = this;
+	if (pointer_lock_window.compare_exchange_strong(self, nullptr))
+	{
+		select_raw_motion(false);
+		XUngrabPointer(g_event_display, CurrentTime);
+		XFlush(g_event_display);
+	}
+}
+
+void window::process_raw_motion(double dx, double dy)
+{
+	// Accumulate fractional motion, deliver whole pixels
+	raw_dx_ += dx;
+	raw_dy_ += dy;
+	int const int_dx = static_cast<int>(raw_dx_);
+	int const int_dy = static_cast<int>(raw_dy_);
+	if (int_dx || int_dy)
+	{
+		raw_dx_ -= int_dx;
+		raw_dy_ -= int_dy;
+		on_input(input_event::mouse(input_event::MOUSE_MOVE, 0, modifiers_,
+			pointer_x_, pointer_y_, int_dx, int_dy));
+	}
 }
 
 void window::show(bool visible)
 {
+	display_lock lock(g_display, g_display_lock_stats);
 	visible? XMapWindow(g_display, window_) : XUnmapWindow(g_display, window_);
 	XFlush(g_display);
 }
 
 void window::set_focus()
 {
+	display_lock lock(g_display, g_display_lock_stats);
 	XSetInputFocus(g_display, window_, RevertToParent, CurrentTime);
+	XFlush(g_display);
 }
 
 rectangle<int> window::rect() const
 {
-	XWindowAttributes attributes;
-	XGetWindowAttributes(g_display, window_, &attributes);
-	return rectangle<int>(attributes.x, attributes.y, attributes.width, attributes.height);
+	boost::mutex::scoped_lock lock(rect_mutex_);
+	return rect_;
+}
+
+rectangle<int> window::query_rect()
+{
+	display_lock lock(g_display, g_display_lock_stats);
+	// Both requests in one round trip, the window position is translated to the root window
+	xcb_connection_t* c = XGetXCBConnection(g_display);
+	xcb_get_geometry_cookie_t const geometry_cookie = xcb_get_geometry(c, window_);
+	xcb_translate_coordinates_cookie_t const translate_cookie = xcb_translate_coordinates(c, window_, g_root, 0, 0);
+	xcb_get_geometry_reply_t* geometry = xcb_get_geometry_reply(c, geometry_cookie, nullptr);
+	xcb_translate_coordinates_reply_t* translate = xcb_translate_coordinates_reply(c, translate_cookie, nullptr);
+
+	boost::mutex::scoped_lock rect_lock(rect_mutex_);
+	if (geometry && translate)
+	{
+		rect_ = rectangle<int>(translate->dst_x, translate->dst_y, geometry->width, geometry->height);
+	}
+	free(geometry);
+	free(translate);
+	return rect_;
 }
 
 void window::set_rect(rectangle<int> const& rect)
 {
+	display_lock lock(g_display, g_display_lock_stats);
 	XWindowChanges changes;
 	changes.x = rect.left;
 	changes.y = rect.top;
 	changes.width = rect.width;
 	changes.height = rect.height;
 	XConfigureWindow(g_display, window_, CWX | CWY | CWWidth | CWHeight, &changes);
+	XFlush(g_display);
+}
+
+// Click and drag thresholds, set by JavaScript and read by the event thread
+static boost::atomic<unsigned> click_time_ms(400);
+static boost::atomic<unsigned> click_distance(4);
+static boost::atomic<unsigned> drag_distance(4);
+
+void window::set_click_thresholds(unsigned time, unsigned distance, unsigned drag_dist)
+{
+	click_time_ms = time;
+	click_distance = distance;
+	drag_distance = drag_dist;
+}
+
+void window::process_button(XEvent const& event, input_event const& e)
+{
+	if (e.type() == input_event::MOUSE_DOWN)
+	{
+		// Server timestamps wrap around in about 49 days
+		int const distance = click_distance;
+		bool const multiple = e.button() == click_button_
+			&& static_cast<uint32_t>(event.xbutton.time - click_time_) <= click_time_ms
+			&& std::abs(e.x() - click_x_) <= distance && std::abs(e.y() - click_y_) <= distance;
+
+		press_button_ = e.button();
+		press_x_ = e.x();
+		press_y_ = e.y();
+		press_count_ = multiple? click_count_ + 1 : 1;
+		dragging_ = false;
+	}
+	else if (press_button_ && e.button() == press_button_)
+	{
+		press_button_ = 0;
+		if (dragging_)
+		{
+			// no click after a drag, and the next press starts a new click count
+			dragging_ = false;
+			click_button_ = 0;
+			return;
+		}
+
+		click_button_ = e.button();
+		click_x_ = press_x_;
+		click_y_ = press_y_;
+		click_time_ = event.xbutton.time;
+		click_count_ = press_count_;
+
+		input_event click = input_event::mouse(input_event::MOUSE_CLICK, e.button(), e.modifiers(), e.x(), e.y());
+		click.repeats() = click_count_;
+		on_input(click);
+	}
+}
+
+void window::process_drag(input_event const& e)
+{
+	if (press_button_ && !dragging_)
+	{
+		int const distance = drag_distance;
+		int const dx = e.x() - press_x_;
+		int const dy = e.y() - press_y_;
+		if (std::abs(dx) > distance || std::abs(dy) > distance)
+		{
+			dragging_ = true;
+			on_input(input_event::mouse(input_event::MOUSE_DRAG_START, press_button_, e.modifiers(),
+				e.x(), e.y(), dx, dy));
+		}
+	}
+}
+
+void window::reset_press()
+{
+	press_button_ = 0;
+	dragging_ = false;
+	click_button_ = 0;
 }
 
 void window::process(XEvent& event)
@@ -710,6 +1648,11 @@ void window::process(XEvent& event)
 		break;
 
 	case FocusIn:
+		// Create the input context on the first focus
+		if (!input_context_)
+		{
+			input_context_ = create_input_context(window_);
+		}
 		// Update the input context
 		if (input_context_)
 		{
@@ -723,10 +1666,77 @@ void window::process(XEvent& event)
 		{
 			XUnsetICFocus(input_context_);
 		}
+		// Key and button releases are not delivered after focus loss
+		reset_keyboard_state();
+		reset_press();
+		break;
+
+	case LeaveNotify:
+		// Another client grabbed the pointer and broke the implicit grab of a press
+		if (event.xcrossing.mode == NotifyGrab)
+		{
+			reset_press();
+		}
+		// Motion into a child window doesn't leave the client area
+		if (event.xcrossing.detail != NotifyInferior)
+		{
+			on_pointer_leave(event.xcrossing.x, event.xcrossing.y);
+		}
+		break;
+
+	case MapNotify:
+		if (!mapped_)
+		{
+			mapped_ = true;
+			uint64_t const map_us = boost::chrono::duration_cast<boost::chrono::microseconds>(
+				boost::chrono::steady_clock::now() - create_time_).count();
+			++g_creation_stats.windows;
+			g_creation_stats.map_us += map_us;
+			for (uint64_t max_us = g_creation_stats.max_map_us; max_us < map_us
+				&& !g_creation_stats.max_map_us.compare_exchange_weak(max_us, map_us); )
+			{
+			}
+		}
+		break;
+
+	case ReparentNotify:
+		parent_ = event.xreparent.parent;
+		parent_x_ = event.xreparent.x;
+		parent_y_ = event.xreparent.y;
+		if (parent_ == g_root)
+		{
+			boost::mutex::scoped_lock lock(rect_mutex_);
+			rect_.left = event.xreparent.x;
+			rect_.top = event.xreparent.y;
+		}
+		// Otherwise the window manager sends a synthetic ConfigureNotify
+		// with the root position after reparenting (ICCCM 4.1.5)
 		break;
 
 	// Resize event
 	case ConfigureNotify:
+		{
+			boost::mutex::scoped_lock lock(rect_mutex_);
+			// Synthetic events from window manager are in root coordinates (ICCCM 4.1.5),
+			// real ones are relative to the parent, the root position is moved by the offset change
+			if (event.xconfigure.send_event || parent_ == g_root)
+			{
+				rect_.left = event.xconfigure.x;
+				rect_.top = event.xconfigure.y;
+			}
+			else
+			{
+				rect_.left += event.xconfigure.x - parent_x_;
+				rect_.top += event.xconfigure.y - parent_y_;
+			}
+			if (!event.xconfigure.send_event)
+			{
+				parent_x_ = event.xconfigure.x;
+				parent_y_ = event.xconfigure.y;
+			}
+			rect_.width = event.xconfigure.width;
+			rect_.height = event.xconfigure.height;
+		}
 		if (event.xconfigure.width != size_.width || event.xconfigure.height != size_.height)
 		{
 			size_.width = event.xconfigure.width;
@@ -735,21 +1745,53 @@ void window::process(XEvent& event)
 		}
 		break;
 
+	// Window manager state changes, i.e. leaving fullscreen with a key binding
+	case PropertyNotify:
+		if (event.xproperty.atom == atoms[ATOM_NET_WM_STATE])
+		{
+			wm_state_changed_ = true;
+		}
+		break;
+
 	// Close event
 	case ClientMessage:
 		if (event.xclient.format == 32 && event.xclient.data.l[0] == atom_close_)
 		{
 			destroy();
-			on_event("close");
+			on_event(CLOSE_EVENT);
 		}
 		break;
 
+	case MotionNotify:
 	case KeyPress:
 	case KeyRelease:
 	case ButtonPress:
 	case ButtonRelease:
-	case MotionNotify:
-		on_input(input_event(event));
+		// Relative motion from raw events is delivered in the pointer lock
+		if (event.type == MotionNotify && pointer_lock_window == this)
+		{
+			break;
+		}
+		{
+			input_event const e(event);
+			modifiers_ = e.modifiers();
+			if (e.is_mouse())
+			{
+				pointer_x_ = e.x();
+				pointer_y_ = e.y();
+			}
+			on_input(e);
+			// Synthesized events follow at the current position, so they don't move
+			// the pointer state or the region under the pointer
+			if (e.type() == input_event::MOUSE_MOVE)
+			{
+				process_drag(e);
+			}
+			else if (e.type() == input_event::MOUSE_DOWN || e.type() == input_event::MOUSE_UP)
+			{
+				process_button(event, e);
+			}
+		}
 		break;
 /*
 	// Key down event
@@ -867,19 +1909,187 @@ uint32_t input_event::type_and_state(int type, unsigned int state)
 	return result;
 }
 
-unsigned to_key_code(unsigned code)
+static uint32_t to_key_code(KeySym key_sym)
 {
-	unsigned const key_sym = XkbKeycodeToKeysym(g_display, code, 0, 0);
 	switch (key_sym)
 	{
 	case XK_KP_Enter:
 		return XK_Return;
 	default:
-		return key_sym;
+		return static_cast<uint32_t>(key_sym);
+	}
+}
+
+// XKB key names to physical key codes, includes common aliases
+static struct { char const* name; physical_key code; } const xkb_key_names[] =
+{
+	{ "ESC",  CODE_ESCAPE },
+	{ "FK01", CODE_F1 }, { "FK02", CODE_F2 }, { "FK03", CODE_F3 }, { "FK04", CODE_F4 },
+	{ "FK05", CODE_F5 }, { "FK06", CODE_F6 }, { "FK07", CODE_F7 }, { "FK08", CODE_F8 },
+	{ "FK09", CODE_F9 }, { "FK10", CODE_F10 }, { "FK11", CODE_F11 }, { "FK12", CODE_F12 },
+	{ "FK13", CODE_F13 }, { "FK14", CODE_F14 }, { "FK15", CODE_F15 }, { "FK16", CODE_F16 },
+	{ "FK17", CODE_F17 }, { "FK18", CODE_F18 }, { "FK19", CODE_F19 }, { "FK20", CODE_F20 },
+	{ "FK21", CODE_F21 }, { "FK22", CODE_F22 }, { "FK23", CODE_F23 }, { "FK24", CODE_F24 },
+
+	{ "TLDE", CODE_BACKQUOTE },
+	{ "AE01", CODE_DIGIT_1 }, { "AE02", CODE_DIGIT_2 }, { "AE03", CODE_DIGIT_3 },
+	{ "AE04", CODE_DIGIT_4 }, { "AE05", CODE_DIGIT_5 }, { "AE06", CODE_DIGIT_6 },
+	{ "AE07", CODE_DIGIT_7 }, { "AE08", CODE_DIGIT_8 }, { "AE09", CODE_DIGIT_9 },
+	{ "AE10", CODE_DIGIT_0 }, { "AE11", CODE_MINUS }, { "AE12", CODE_EQUAL },
+	{ "BKSP", CODE_BACKSPACE },
+
+	{ "TAB",  CODE_TAB },
+	{ "AD01", CODE_Q }, { "AD02", CODE_W }, { "AD03", CODE_E }, { "AD04", CODE_R },
+	{ "AD05", CODE_T }, { "AD06", CODE_Y }, { "AD07", CODE_U }, { "AD08", CODE_I },
+	{ "AD09", CODE_O }, { "AD10", CODE_P },
+	{ "AD11", CODE_BRACKET_LEFT }, { "AD12", CODE_BRACKET_RIGHT },
+	{ "BKSL", CODE_BACKSLASH }, { "AC12", CODE_BACKSLASH },
+
+	{ "CAPS", CODE_CAPS_LOCK },
+	{ "AC01", CODE_A }, { "AC02", CODE_S }, { "AC03", CODE_D }, { "AC04", CODE_F },
+	{ "AC05", CODE_G }, { "AC06", CODE_H }, { "AC07", CODE_J }, { "AC08", CODE_K },
+	{ "AC09", CODE_L }, { "AC10", CODE_SEMICOLON }, { "AC11", CODE_QUOTE },
+	{ "RTRN", CODE_ENTER },
+
+	{ "LFSH", CODE_SHIFT_LEFT }, { "LSGT", CODE_INTL_BACKSLASH },
+	{ "AB01", CODE_Z }, { "AB02", CODE_X }, { "AB03", CODE_C }, { "AB04", CODE_V },
+	{ "AB05", CODE_B }, { "AB06", CODE_N }, { "AB07", CODE_M },
+	{ "AB08", CODE_COMMA }, { "AB09", CODE_PERIOD }, { "AB10", CODE_SLASH },
+	{ "RTSH", CODE_SHIFT_RIGHT },
+
+	{ "LCTL", CODE_CONTROL_LEFT }, { "LWIN", CODE_META_LEFT }, { "LMTA", CODE_META_LEFT },
+	{ "LALT", CODE_ALT_LEFT }, { "SPCE", CODE_SPACE },
+	{ "RALT", CODE_ALT_RIGHT }, { "ALGR", CODE_ALT_RIGHT },
+	{ "RWIN", CODE_META_RIGHT }, { "RMTA", CODE_META_RIGHT },
+	{ "COMP", CODE_CONTEXT_MENU }, { "MENU", CODE_CONTEXT_MENU },
+	{ "RCTL", CODE_CONTROL_RIGHT },
+
+	{ "PRSC", CODE_PRINT_SCREEN }, { "SCLK", CODE_SCROLL_LOCK }, { "PAUS", CODE_PAUSE },
+	{ "INS",  CODE_INSERT }, { "HOME", CODE_HOME }, { "PGUP", CODE_PAGE_UP },
+	{ "DELE", CODE_DELETE }, { "END",  CODE_END }, { "PGDN", CODE_PAGE_DOWN },
+	{ "UP",   CODE_ARROW_UP }, { "LEFT", CODE_ARROW_LEFT },
+	{ "DOWN", CODE_ARROW_DOWN }, { "RGHT", CODE_ARROW_RIGHT },
+
+	{ "NMLK", CODE_NUM_LOCK }, { "KPDV", CODE_NUMPAD_DIVIDE }, { "KPMU", CODE_NUMPAD_MULTIPLY },
+	{ "KPSU", CODE_NUMPAD_SUBTRACT }, { "KPAD", CODE_NUMPAD_ADD }, { "KPEN", CODE_NUMPAD_ENTER },
+	{ "KPDL", CODE_NUMPAD_DECIMAL }, { "KPEQ", CODE_NUMPAD_EQUAL },
+	{ "KP0", CODE_NUMPAD_0 }, { "KP1", CODE_NUMPAD_1 }, { "KP2", CODE_NUMPAD_2 },
+	{ "KP3", CODE_NUMPAD_3 }, { "KP4", CODE_NUMPAD_4 }, { "KP5", CODE_NUMPAD_5 },
+	{ "KP6", CODE_NUMPAD_6 }, { "KP7", CODE_NUMPAD_7 }, { "KP8", CODE_NUMPAD_8 },
+	{ "KP9", CODE_NUMPAD_9 },
+};
+
+static physical_key to_physical_key(char const (&key_name)[XkbKeyNameLength])
+{
+	for (auto const& entry : xkb_key_names)
+	{
+		if (strncmp(entry.name, key_name, XkbKeyNameLength) == 0)
+		{
+			return entry.code;
+		}
 	}
+	return CODE_UNKNOWN;
+}
+
+void update_keymap()
+{
+	boost::shared_ptr<keymap_table> const table(new keymap_table);
+
+	int min_keycode = 8, max_keycode = 255;
+	XDisplayKeycodes(g_event_display, &min_keycode, &max_keycode);
+
+	// Key names are fetched once per keymap, they don't depend on the layout
+	XkbDescPtr xkb = XkbGetMap(g_event_display, 0, XkbUseCoreKbd);
+	if (xkb && XkbGetNames(g_event_display, XkbKeyNamesMask, xkb) != Success)
+	{
+		XkbFreeKeyboard(xkb, 0, True);
+		xkb = nullptr;
+	}
+
+	for (int code = 0; code < 256; ++code)
+	{
+		key_info& key = table->keys[code];
+		std::fill(key.syms, key.syms + key_info::levels, NoSymbol);
+		key.key_code = 0;
+		key.code = CODE_UNKNOWN;
+		key.name = "";
+
+		if (code < min_keycode || code > max_keycode)
+		{
+			continue;
+		}
+
+		for (unsigned level = 0; level < key_info::levels; ++level)
+		{
+			key.syms[level] = XkbKeycodeToKeysym(g_event_display, static_cast<KeyCode>(code), 0, level);
+		}
+		key.key_code = to_key_code(key.syms[0]);
+		if (char const* name = XKeysymToString(key.key_code))
+		{
+			key.name = name;
+		}
+		if (xkb && xkb->names && xkb->names->keys
+			&& code >= xkb->min_key_code && code <= xkb->max_key_code)
+		{
+			key.code = to_physical_key(xkb->names->keys[code].name);
+		}
+	}
+
+	if (xkb)
+	{
+		XkbFreeKeyboard(xkb, 0, True);
+	}
+
+	boost::atomic_store(&current_keymap, keymap_table_ptr(table));
+}
+
+key_info keymap(unsigned keycode)
+{
+	keymap_table_ptr const table = boost::atomic_load(&current_keymap);
+	if (!table)
+	{
+		key_info const none = { {}, 0, CODE_UNKNOWN, "" };
+		return none;
+	}
+	return table->keys[keycode & 0xFF];
+}
+
+// Name from the keymap table, nullptr if the keysym doesn't match the keycode mapping
+static char const* keymap_name(unsigned keycode, KeySym key_sym)
+{
+	if (keycode < 256)
+	{
+		key_info const key = keymap(keycode);
+		if (key.key_code == key_sym)
+		{
+			return key.name;
+		}
+	}
+	return nullptr;
+}
+
+char const* keysym_name(unsigned keycode, KeySym key_sym)
+{
+	char const* name = keymap_name(keycode, key_sym);
+	if (!name)
+	{
+		name = XKeysymToString(key_sym);
+	}
+	return name? name : "";
+}
+
+v8::Local<v8::String> keysym_string(v8::Isolate* isolate, string_cache& names, unsigned keycode, KeySym key_sym)
+{
+	// Names in keymap tables are interned by Xlib, their pointers stay valid
+	if (char const* name = keymap_name(keycode, key_sym))
+	{
+		return names.get(name);
+	}
+	return v8::String::NewFromUtf8(isolate, keysym_name(keycode, key_sym));
 }
 
 input_event::input_event(event const& e)
+	: region_(0)
 {
 	switch (e.type)
 	{
@@ -887,18 +2097,34 @@ input_event::input_event(event const& e)
 	case KeyRelease:
 		if (window* wnd = get_window(e))
 		{
-			KeySym key_sym;
-			char chars[6] = {};
-			int const chars_len = Xutf8LookupString(wnd->input_context_, const_cast<XKeyEvent*>(&e.xkey),
-				chars, sizeof(chars), &key_sym, NULL);
-
 			type_and_state_ = type_and_state(e.type, e.xkey.state);
-			data_.key.vk_code = to_key_code(e.xkey.keycode);
+			key_info const key = keymap(e.xkey.keycode);
+			data_.key.vk_code = key.key_code;
 			data_.key.scan_code = e.xkey.keycode;
+			data_.key.code = key.code;
 			if (e.type == KeyPress)
 			{
-				wnd->pressed_key_code_ = key_sym;
-				utils::from_utf8(chars, chars + chars_len, &wnd->pressed_char_code_);
+				// Text lookup is required only for key press, it goes through the input method
+				KeySym key_sym = NoSymbol;
+				char chars[6] = {};
+				XKeyEvent& key_event = const_cast<XKeyEvent&>(e.xkey);
+				wnd->pressed_char_code_ = 0;
+				if (wnd->input_context_)
+				{
+					int const chars_len = Xutf8LookupString(wnd->input_context_, &key_event, chars, sizeof(chars), &key_sym, nullptr);
+					utils::from_utf8(chars, chars + std::max(chars_len, 0), &wnd->pressed_char_code_);
+				}
+				else if (XLookupString(&key_event, chars, sizeof(chars), &key_sym, nullptr) > 0)
+				{
+					// Without an input method the text is Latin-1, one byte for a key
+					wnd->pressed_char_code_ = static_cast<unsigned char>(chars[0]);
+				}
+				else if ((key_sym & 0xFF000000) == 0x01000000)
+				{
+					// Keysyms out of Latin-1 are Unicode code points with 0x01000000 offset
+					wnd->pressed_char_code_ = static_cast<uint32_t>(key_sym & 0x00FFFFFF);
+				}
+				wnd->pressed_key_code_ = static_cast<uint32_t>(key_sym);
 			}
 			data_.key.key_code = wnd->pressed_key_code_;
 			data_.key.char_code = wnd->pressed_char_code_;
@@ -3,18 +3,110 @@
 
 #include "jsx/library.hpp"
 
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+
 namespace aspect { namespace gui {
 
+// Display objects are cached per isolate by display identifier,
+// repeated calls return the same objects updated in place
+#if OS(WINDOWS)
+typedef std::wstring display_key;
+static display_key key_of(display const& disp) { return disp.name; }
+#elif OS(DARWIN)
+typedef CGDirectDisplayID display_key;
+static display_key key_of(display const& disp) { return disp.id; }
+#else
+typedef RROutput display_key;
+static display_key key_of(display const& disp) { return disp.output; }
+#endif
+
+struct display_wrapper
+{
+	display* ptr; // owned by the JavaScript object
+	v8::Persistent<v8::Object, v8::CopyablePersistentTraits<v8::Object>> object;
+};
+
+typedef std::map<display_key, display_wrapper> display_wrappers;
+typedef std::map<v8::Isolate*, display_wrappers> display_cache_map;
+static display_cache_map display_cache;
+static boost::mutex display_cache_mutex;
+
+static v8::Handle<v8::Object> display_to_v8(v8::Isolate* isolate, display const& disp)
+{
+	v8::EscapableHandleScope scope(isolate);
+
+	boost::mutex::scoped_lock lock(display_cache_mutex);
+
+	display_wrappers& wrappers = display_cache[isolate];
+	display_key const key = key_of(disp);
+	display_wrappers::iterator it = wrappers.find(key);
+	if (it == wrappers.end())
+	{
+		display_wrapper wrapper;
+		wrapper.ptr = new display(disp);
+		v8::Local<v8::Object> object = v8pp::class_<display>::import_external(isolate, wrapper.ptr);
+		wrapper.object.Reset(isolate, object);
+		wrappers.emplace(key, wrapper);
+		return scope.Escape(object);
+	}
+
+	*it->second.ptr = disp;
+	return scope.Escape(v8::Local<v8::Object>::New(isolate, it->second.object));
+}
+
+static void clear_display_cache(v8::Isolate* isolate)
+{
+	boost::mutex::scoped_lock lock(display_cache_mutex);
+
+	display_cache_map::iterator it = display_cache.find(isolate);
+	if (it != display_cache.end())
+	{
+		for (auto& item : it->second)
+		{
+			item.second.object.Reset();
+		}
+		display_cache.erase(it);
+	}
+}
+
+// Remove wrappers of displays not in the enumerated ones, i.e. for unplugged outputs
+static void prune_display_cache(v8::Isolate* isolate, std::vector<display> const& displays)
+{
+	boost::mutex::scoped_lock lock(display_cache_mutex);
+
+	display_cache_map::iterator it = display_cache.find(isolate);
+	if (it == display_cache.end())
+	{
+		return;
+	}
+	display_wrappers& wrappers = it->second;
+	for (display_wrappers::iterator wrapper = wrappers.begin(); wrapper != wrappers.end(); )
+	{
+		display_key const key = wrapper->first;
+		if (std::none_of(displays.begin(), displays.end(), [key](display const& disp) { return key_of(disp) == key; }))
+		{
+			wrapper->second.object.Reset();
+			wrapper = wrappers.erase(wrapper);
+		}
+		else
+		{
+			++wrapper;
+		}
+	}
+}
+
 static void display_enumerate_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
 {
 	v8::Isolate* isolate = args.GetIsolate();
 	v8::EscapableHandleScope scope(isolate);
 
 	std::vector<display> result = display::enumerate();
+	prune_display_cache(isolate, result);
 	v8::Local<v8::Array> arr = v8::Array::New(isolate, static_cast<int>(result.size()));
 	for (uint32_t i = 0; i < result.size(); ++i)
 	{
-		arr->Set(i, v8pp::class_<display>::import_external(isolate, new display(result[i])));
+		arr->Set(i, display_to_v8(isolate, result[i]));
 	}
 	args.GetReturnValue().Set(scope.Escape(arr));
 }
@@ -23,7 +115,7 @@ static void display_primary_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
 {
 	v8::Isolate* isolate = args.GetIsolate();
 
-	args.GetReturnValue().Set(v8pp::class_<display>::import_external(isolate, new display(display::primary())));
+	args.GetReturnValue().Set(display_to_v8(isolate, display::primary()));
 }
 
 static void display_from_window_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
@@ -35,14 +127,175 @@ static void display_from_window_v8(v8::FunctionCallbackInfo<v8::Value> const& ar
 	{
 		throw std::invalid_argument("required window argument");
 	}
-	args.GetReturnValue().Set(v8pp::class_<display>::import_external(isolate, new display(display::from_window(wnd))));
+	args.GetReturnValue().Set(display_to_v8(isolate, display::from_window(wnd)));
+}
+
+// Garbage collection pauses by isolate, measured with GC prologue and epilogue callbacks
+// in the isolate thread, to compare with the event dispatch costs
+struct gc_stats
+{
+	uint64_t count;    // number of collections
+	uint64_t total_us; // total pause time in microseconds
+	uint64_t max_us;   // longest pause in microseconds
+	boost::chrono::steady_clock::time_point start;
+};
+
+static std::map<v8::Isolate*, gc_stats> gc_stats_map;
+static boost::mutex gc_stats_mutex;
+
+static void gc_prologue(v8::Isolate* isolate, v8::GCType, v8::GCCallbackFlags)
+{
+	boost::mutex::scoped_lock lock(gc_stats_mutex);
+	gc_stats_map[isolate].start = boost::chrono::steady_clock::now();
+}
+
+static void gc_epilogue(v8::Isolate* isolate, v8::GCType, v8::GCCallbackFlags)
+{
+	boost::chrono::steady_clock::time_point const end = boost::chrono::steady_clock::now();
+
+	boost::mutex::scoped_lock lock(gc_stats_mutex);
+	gc_stats& stats = gc_stats_map[isolate];
+	uint64_t const pause_us = boost::chrono::duration_cast<boost::chrono::microseconds>(end - stats.start).count();
+	++stats.count;
+	stats.total_us += pause_us;
+	stats.max_us = std::max(stats.max_us, pause_us);
+}
+
+static void start_gc_stats(v8::Isolate* isolate)
+{
+	{
+		boost::mutex::scoped_lock lock(gc_stats_mutex);
+		gc_stats_map[isolate] = gc_stats();
+	}
+	isolate->AddGCPrologueCallback(gc_prologue);
+	isolate->AddGCEpilogueCallback(gc_epilogue);
+}
+
+static void stop_gc_stats(v8::Isolate* isolate)
+{
+	isolate->RemoveGCPrologueCallback(gc_prologue);
+	isolate->RemoveGCEpilogueCallback(gc_epilogue);
+
+	boost::mutex::scoped_lock lock(gc_stats_mutex);
+	gc_stats_map.erase(isolate);
+}
+
+static void window_gc_stats_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
+{
+	v8::Isolate* isolate = args.GetIsolate();
+	v8::EscapableHandleScope scope(isolate);
+
+	gc_stats stats;
+	{
+		boost::mutex::scoped_lock lock(gc_stats_mutex);
+		stats = gc_stats_map[isolate];
+	}
+
+	v8::Local<v8::Object> result = v8::Object::New(isolate);
+	set_option(isolate, result, "count", static_cast<double>(stats.count));
+	set_option(isolate, result, "time", stats.total_us / 1000.0);
+	set_option(isolate, result, "maxTime", stats.max_us / 1000.0);
+	args.GetReturnValue().Set(scope.Escape(result));
+}
+
+#if !OS(WINDOWS) && !OS(DARWIN)
+static v8::Handle<v8::Object> lock_stats_to_v8(v8::Isolate* isolate, lock_stats const& stats)
+{
+	v8::EscapableHandleScope scope(isolate);
+
+	v8::Local<v8::Object> result = v8::Object::New(isolate);
+	set_option(isolate, result, "locks", static_cast<double>(stats.locks));
+	set_option(isolate, result, "contended", static_cast<double>(stats.contended));
+	set_option(isolate, result, "waitTime", stats.wait_us / 1000.0);
+	return scope.Escape(result);
+}
+
+static void window_lock_stats_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
+{
+	v8::Isolate* isolate = args.GetIsolate();
+	v8::EscapableHandleScope scope(isolate);
+
+	v8::Local<v8::Object> result = v8::Object::New(isolate);
+	set_option(isolate, result, "request", lock_stats_to_v8(isolate, g_display_lock_stats));
+	set_option(isolate, result, "event", lock_stats_to_v8(isolate, g_event_display_lock_stats));
+	args.GetReturnValue().Set(scope.Escape(result));
+}
+
+static void window_creation_stats_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
+{
+	v8::Isolate* isolate = args.GetIsolate();
+	v8::EscapableHandleScope scope(isolate);
+
+	uint64_t const windows = g_creation_stats.windows;
+	v8::Local<v8::Object> result = v8::Object::New(isolate);
+	set_option(isolate, result, "windows", static_cast<double>(windows));
+	set_option(isolate, result, "averageMapTime", windows? g_creation_stats.map_us / 1000.0 / windows : 0.0);
+	set_option(isolate, result, "maxMapTime", g_creation_stats.max_map_us / 1000.0);
+	args.GetReturnValue().Set(scope.Escape(result));
+}
+
+static void window_resource_stats_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
+{
+	v8::Isolate* isolate = args.GetIsolate();
+	v8::EscapableHandleScope scope(isolate);
+
+	v8::Local<v8::Object> result = v8::Object::New(isolate);
+	set_option(isolate, result, "windows", static_cast<int>(g_resource_stats.windows));
+	set_option(isolate, result, "colormaps", static_cast<int>(g_resource_stats.colormaps));
+	set_option(isolate, result, "cursors", static_cast<int>(g_resource_stats.cursors));
+	set_option(isolate, result, "inputContexts", static_cast<int>(g_resource_stats.input_contexts));
+	args.GetReturnValue().Set(scope.Escape(result));
+}
+
+static void window_create_cursor_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
+{
+	v8::Isolate* isolate = args.GetIsolate();
+
+	unsigned const width = v8pp::from_v8<unsigned>(isolate, args[0]);
+	unsigned const height = v8pp::from_v8<unsigned>(isolate, args[1]);
+	int const hot_x = v8pp::from_v8<int>(isolate, args[2]);
+	int const hot_y = v8pp::from_v8<int>(isolate, args[3]);
+	if (!args[4]->IsUint32Array())
+	{
+		throw std::invalid_argument("required Uint32Array pixels argument");
+	}
+	v8::Local<v8::Uint32Array> pixels = args[4].As<v8::Uint32Array>();
+	uint32_t const* data = reinterpret_cast<uint32_t const*>(
+		static_cast<char const*>(pixels->Buffer()->GetContents().Data()) + pixels->ByteOffset());
+	args.GetReturnValue().Set(window::create_cursor(width, height, hot_x, hot_y, data, pixels->Length()));
+}
+
+static void window_pool_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
+{
+	v8::Isolate* isolate = args.GetIsolate();
+	unsigned const count = args[1]->IsUndefined()? 1 : v8pp::from_v8<unsigned>(isolate, args[1]);
+	window::reserve(creation_args(args), count);
+}
+#endif
+
+static void window_stop_recording_v8(v8::FunctionCallbackInfo<v8::Value> const& args)
+{
+	args.GetReturnValue().Set(static_cast<double>(window::stop_recording()));
 }
 
+// The module is installed in each isolate using it, i.e. in workers
+// receiving routed events, the window system is shared by all of them
+static unsigned install_count = 0;
+static boost::mutex install_mutex;
+
 DECLARE_LIBRARY_ENTRYPOINTS(oxygen_install, oxygen_uninstall);
 
 v8::Handle<v8::Value> oxygen_install(v8::Isolate* isolate)
 {
-	window::init();
+	{
+		boost::mutex::scoped_lock lock(install_mutex);
+		if (install_count == 0)
+		{
+			window::init();
+		}
+		++install_count;
+	}
+	start_gc_stats(isolate);
 
 	v8pp::module oxygen_module(isolate);
 
@@ -117,6 +370,24 @@ v8::Handle<v8::Value> oxygen_install(v8::Isolate* isolate)
 		Current display mode.
 		**/
 		.set("currentMode", &display::current_mode)
+
+		/**
+		@function setMode(mode)
+		@param mode {Mode}
+		@return {Boolean}
+		Change display mode to one of `modes()`. Zero `frequency` selects
+		the highest refresh rate for the mode dimensions and color depth.
+		Return `false` if the mode is not supported.
+		On X Window system only the display monitor is changed, the mode
+		should fit into the current screen size.
+		**/
+		.set("setMode", &display::set_mode)
+
+		/**
+		@function restoreMode()
+		Restore display mode changed with `setMode()`.
+		**/
+		.set("restoreMode", &display::restore_mode)
 		;
 	oxygen_module.set("Display", display_class);
 
@@ -142,6 +413,7 @@ v8::Handle<v8::Value> oxygen_install(v8::Isolate* isolate)
 	Additionally `key_event` has attributes:
 	  * `vk_code`    Virtual key code, see #keys
 	  * `key_code`   Platform-specific key code
+	  * `code`       Physical key code independent from keyboard layout, see #codes
 	  * `char`       Character for `char` event
 	  * `key_sym`    Key symbol (in X Window system only)
 
@@ -149,6 +421,7 @@ v8::Handle<v8::Value> oxygen_install(v8::Isolate* isolate)
 	  * `button`     Pressed mouse button (0 -none, 1 - left, 2 -middle, 3 - right, 4, 5, ... - X1, X2, ...)
 	  * `x`, `y`     Current mouse coordinates
 	  * `dx`, `dy`   Scroll delta for mouse wheel events
+	  * `region`     Topmost hit-test region id under the mouse, see `setRegions()`
 
 	@event close()
 
@@ -172,6 +445,18 @@ v8::Handle<v8::Value> oxygen_install(v8::Isolate* isolate)
 	@event mousedown(mouse_event)
 	@event mouseup(mouse_event)
 	@event mouseclick(mouse_event)
+	Click with `repeats` set to the click count, i.e. `2` for a double click.
+	On X Window system clicks are synthesized from button events, see `setClickThresholds()`
+
+	@event dragstart(mouse_event) - X Window system only
+	Pointer moved with a pressed `button` over the drag distance, emitted after
+	the `mousemove` event. `x`, `y` are the current position and `dx`, `dy`
+	are the offset from the press position, i.e. the press was at `x - dx`, `y - dy`
+
+	@event regionenter(mouse_event)
+	@event regionleave(mouse_event)
+	Pointer entered or left the hit-test `region`, emitted before the mouse event
+	that caused the transition, see `setRegions()`
 	**/
 
 	/**
@@ -186,7 +471,15 @@ v8::Handle<v8::Value> oxygen_install(v8::Isolate* isolate)
 	  * `left`  Window client area left corner screen position.
 	  * `top` Window client area top corner screen position.
 	  * `bpp` Window color depth (bits per pixel), default value is current video mode color depth.
+	  * `display` Display instance for the window, default is the primary display.
+	     A `FULLSCREEN` style window changes the mode of this display, or of the display
+	     under the window rectangle if it is unspecified (X Window system).
+	  * `frequency` Display refresh rate (Hz) for `FULLSCREEN` style windows with dimensions
+	     other than the current video mode, default value 0 selects the highest rate (X Window system only).
 	  * `style` Set specific window style. See #styles
+	  * `reuseEvents` Pass pooled input event objects to listeners to reduce garbage collection,
+	     default is `false`. A listener must not keep the event object after return,
+	     its fields are overwritten by a later event of the same type.
 	  * `caption` Window caption string.
 	  * `icon` Window icon file name (currently implemented in Windows only).
 	  * `splash` Splash image file name (currently implemented in Windows only).
@@ -217,6 +510,25 @@ v8::Handle<v8::Value> oxygen_install(v8::Isolate* isolate)
 		Remove handler function for `event`. See allowed events above.
 		**/
 		.set("off", &window::off)
+		/**
+		@function addListener(event, handler)
+		Same as `on()`.
+		@function once(event, handler)
+		Set `handler` function for `event`, removed before its first call.
+		@function removeListener(event, handler)
+		Remove the last added `handler` function for `event`.
+		@function removeAllListeners([event])
+		Remove handler functions for `event`, or for all events.
+		@function emit(event, args...)
+		Call handler functions for `event` with `args`, return `true` if there were any.
+		All handlers are kept in the window listener table, including the ones added with
+		these functions. An exception thrown by a handler is reported and doesn't stop other handlers.
+		**/
+		.set("addListener", &window::on)
+		.set("once", &window::once_v8)
+		.set("removeListener", &window::remove_listener_v8)
+		.set("removeAllListeners", &window::remove_all_listeners_v8)
+		.set("emit", &window::emit_v8)
 
 		/**
 		@property width {Number} Client area width
@@ -228,14 +540,165 @@ v8::Handle<v8::Value> oxygen_install(v8::Isolate* isolate)
 		**/
 		.set("height", v8pp::property(&window::height))
 
+		/**
+		@property keyboardState {Uint32Array} Keyboard state, updated by the native
+		event thread and readable without any native call, i.e. once per frame.
+		Elements `0` - `7` contain a bitset of pressed keys, indexed by key `scan_code`:
+		`(state[code >> 5] >>> (code & 31)) & 1`
+		Element `8` contains modifiers state bits: `1` - ctrl, `2` - alt, `4` - shift,
+		`8` - lbutton, `16` - mbutton, `32` - rbutton, `64` - xbutton1, `128` - xbutton2
+		The array buffer is owned by the native side. Transferring it, i.e. in the
+		`postMessage()` transfer list, detaches this array: it becomes empty, while
+		the event thread keeps updating the native memory that is no longer visible
+		and the property keeps returning the detached array. Copy the array instead.
+		**/
+		.set("keyboardState", v8pp::property(&window::keyboard_state))
+
+		/**
+		@property pointerState {Int32Array} Pointer state, updated by the native
+		event thread and readable without any native call, i.e. once per frame.
+		Elements are:
+		  * `0`, `1` - latest pointer `x`, `y` coordinates
+		  * `2`      - mouse buttons state bits: `8` - lbutton, `16` - mbutton,
+		               `32` - rbutton, `64` - xbutton1, `128` - xbutton2
+		  * `3`, `4` - accumulated mouse wheel `dx`, `dy`
+		  * `5`, `6` - accumulated pointer motion `dx`, `dy`
+		  * `7`      - update sequence, odd while the event thread writes an update
+		Accumulated values are running totals, so they never need to be reset.
+		Take the deltas since the previous frame as `(total - previous)|0`
+		Read a consistent state by retrying while the update is in progress:
+		```
+		var state = window.pointerState, seq, x, y;
+		do {
+			seq = state[7];
+			x = state[0]; y = state[1];
+		} while ((seq & 1) || seq !== state[7]);
+		```
+		Don't transfer the array buffer, it is detached as for `keyboardState`.
+		**/
+		.set("pointerState", v8pp::property(&window::pointer_state))
+
 		/**
 		@function getRect()
 		@return {Rectangle}
 		Return window rectangle.
 		Rectangle is an object with `left`, `top`, `width`, `height` attributes.
+		On X Window system the rectangle is cached from window configuration events,
+		see also `queryRect()`.
 		**/
 		.set("getRect", &window::rect)
 
+		/**
+		@property id {Number} Window number, unique in the process, stored in event recordings
+		**/
+		.set("id", v8pp::property(&window::id))
+		/**
+		@function startRecording(filename)
+		@param filename {String}
+		Start recording input, `resize`, `close`, `move` and `frame` events
+		of all windows into a binary file. Each record contains the event,
+		the time since the recording start, and the window `id`.
+		**/
+		.set("startRecording", &window::start_recording)
+		/**
+		@function stopRecording()
+		@return {Number}
+		Stop recording, return number of recorded events.
+		**/
+		.set("stopRecording", window_stop_recording_v8)
+		/**
+		@function replay(filename [, speed [, id]])
+		@param filename {String} Recording file, see `startRecording()`
+		@param [speed=1] {Number} Time scale, i.e. `2` replays twice faster, `0` as fast as possible
+		@param [id=0] {Number} Replay only events of the window with this `id`, `0` for all windows
+		Replay recorded events into the window from a background thread.
+		Live input of the window is ignored and recorded `close` events are skipped
+		during the replay. Event `replayend` is emitted when the replay is finished.
+		**/
+		.set("replay", &window::replay_v8)
+		/**
+		@function stopReplay()
+		Stop replay started with `replay()`.
+		**/
+		.set("stopReplay", &window::stop_replay)
+
+		/**
+		@function setRegions(regions)
+		@param regions {Int32Array} Region records of 6 elements: `id, z, left, top, width, height`
+		Replace hit-test regions of the window. The native event thread sets `region`
+		attribute of mouse events to the topmost region id under the pointer, `0`
+		for none, and emits `regionenter` and `regionleave` events on transitions
+		between regions, so listeners of `mousemove` events are not required.
+		Transitions are also emitted when the pointer leaves the window, and when
+		the replaced regions change the region under the last pointer position.
+		The region with the highest `z` is the topmost one, the later one for equal `z`.
+		Region `id` must not be `0`.
+		**/
+		.set("setRegions", &window::set_regions)
+		/**
+		@function clearRegions()
+		Remove all hit-test regions.
+		**/
+		.set("clearRegions", &window::clear_regions)
+		/**
+		@function regionAt(x, y)
+		@param x {Number}
+		@param y {Number}
+		@return {Number}
+		Return the topmost hit-test region id at a point, `0` if none.
+		**/
+		.set("regionAt", &window::region_at)
+
+		/**
+		@function setQueuePolicy(type, policy)
+		@param type {String} Event type, i.e. `mousemove`, `keydown`, `resize`
+		@param policy {String} One of:
+		  * `keep`   Deliver every event, drop only when the queue is full. Continuous events
+		     queued before a discrete one are merged, with summed `dx` and `dy` for mouse events
+		  * `latest` Deliver only the latest event of the type, it replaces a not yet delivered one
+		     and is never dropped
+		  * `drop`   Deliver every event, drop over the limit
+		Set how events are queued for JavaScript listeners while the JavaScript thread
+		is busy. Default policy is `latest` for `mousemove`, `resize`, `move`
+		and `frame` events and `keep` for others. With the `latest` policy motion
+		deltas of skipped `mousemove` events are still accumulated in `pointerState`.
+		Events are dispatched in order. A `latest` event takes no queue slot and is dispatched
+		in the place of the newest one, so a flood of motion doesn't delay key, button
+		and `close` events. The `latest` policy is for continuous events (motion, wheel,
+		resize, move, frame), it acts as `drop` for discrete events.
+		**/
+		.set("setQueuePolicy", &window::set_queue_policy)
+		/**
+		@function setQueueLimit(limit)
+		@param limit {Number}
+		Set number of queued events over which events with the `drop` policy, or with
+		the `latest` policy for discrete events, are dropped, up to the queue capacity.
+		Default value is 3/4 of the capacity.
+		**/
+		.set("setQueueLimit", &window::set_queue_limit)
+		/**
+		@function queueStats()
+		@return {Object}
+		Window event queue statistics. Return an object with attributes:
+		  * `size`       Number of currently queued events
+		  * `limit`      Queue limit, see `setQueueLimit()`
+		  * `capacity`   Maximum number of queued events
+		  * `highWater`  Maximum number of queued events so far
+		  * `dropped`    Number of events dropped by the queue limit or capacity
+		  * `coalesced`  Number of events replaced by the `latest` policy or merged before a discrete event
+		**/
+		.set("queueStats", &window::queue_stats)
+#if !OS(WINDOWS) && !OS(DARWIN)
+		/**
+		@function queryRect()
+		@return {Rectangle}
+		Query window rectangle from the X server, X Window system only.
+		Takes a round trip to the server, use it when the cached `getRect()`
+		value could be outdated, i.e. right after `setRect()`.
+		**/
+		.set("queryRect", &window::query_rect)
+#endif
+
 		/**
 		@function setRect(rect)
 		@param rect {Rectangle}
@@ -303,6 +766,117 @@ v8::Handle<v8::Value> oxygen_install(v8::Isolate* isolate)
 		**/
 #if OS(WINDOWS) || OS(DARWIN)
 		.set("runFileDialog", &window::run_file_dialog)
+#endif
+		/**
+		@function gcStats()
+		@return {Object}
+		Garbage collection pauses in this isolate since the module install,
+		to compare with event dispatch costs. Return an object with attributes:
+		  * `count`      Number of garbage collections
+		  * `time`       Total pause time, milliseconds
+		  * `maxTime`    Longest pause, milliseconds
+		**/
+		.set("gcStats", window_gc_stats_v8)
+#if !OS(WINDOWS) && !OS(DARWIN)
+		/**
+		@function lockStats()
+		@return {Object}
+		Xlib display lock contention statistics, X Window system only.
+		Return an object with `request` and `event` attributes for the connection
+		used by JavaScript calls and for the connection owned by the event thread.
+		Each of them has following attributes:
+		  * `locks`      Number of lock acquisitions
+		  * `contended`  Number of acquisitions waited for another thread owning the lock,
+		                 not counting the event thread polls that skip a busy `request` connection
+		  * `waitTime`   Total time waited in contended acquisitions, milliseconds
+		**/
+		.set("lockStats", window_lock_stats_v8)
+		/**
+		@function creationStats()
+		@return {Object}
+		Window creation latency statistics, X Window system only.
+		Time is measured from the window constructor call to the first
+		`MapNotify` event for the window. Return an object with attributes:
+		  * `windows`         Number of mapped windows
+		  * `averageMapTime`  Average time to map a window, milliseconds
+		  * `maxMapTime`      Maximum time to map a window, milliseconds
+		**/
+		.set("creationStats", window_creation_stats_v8)
+		/**
+		@function resourceStats()
+		@return {Object}
+		Number of X resources used by windows, X Window system only.
+		Colormaps and cursors are shared by all windows and released with the last window.
+		Return an object with attributes:
+		  * `windows`        Number of windows
+		  * `colormaps`      Number of colormaps, one per visual
+		  * `cursors`        Number of cursors, hidden and stock ones
+		  * `inputContexts`  Number of input contexts, created on first window focus
+		**/
+		.set("resourceStats", window_resource_stats_v8)
+		/**
+		@function setClickThresholds(time, distance, dragDistance)
+		@param time {Number} Maximum time between clicks of a multiple click, milliseconds
+		@param distance {Number} Maximum pointer distance between clicks of a multiple click, pixels
+		@param dragDistance {Number} Pointer distance from a button press to start a drag, pixels
+		Thresholds for `mouseclick` and `dragstart` events, X Window system only.
+		Default values are 400 ms, 4 and 4 pixels. Time is measured with X server timestamps.
+		**/
+		.set("setClickThresholds", &window::set_click_thresholds)
+		/**
+		@function pool(options [, count])
+		@param options {Object} Window options, see #Window
+		@param [count=1] {Number}
+		Keep `count` windows created in advance and not shown, X Window system only.
+		A new window with the same `style` and `bpp` options is taken from the pool,
+		moved, resized and shown without round trips to the X server.
+		Other options are applied to a pooled window as to a new one.
+		The pool is filled in this call and refilled on a next main loop turn
+		after a window has been taken. Use `count = 0` to release the pool.
+		Fullscreen windows are taken from the pool for the same options without `fullscreen` style.
+		**/
+		.set("pool", window_pool_v8)
+		/**
+		@function loadCursor(name)
+		@param name {String}
+		@return {Number}
+		Load a cursor by name from the cursor theme, or from a Xcursor file when `name`
+		contains `/`, X Window system only. Return cursor id for `setImageCursor()`.
+		Cursors are cached by name, repeated calls return the same id.
+		**/
+		.set("loadCursor", &window::load_cursor)
+		/**
+		@function createCursor(width, height, hotX, hotY, pixels)
+		@param width {Number}
+		@param height {Number}
+		@param hotX {Number}
+		@param hotY {Number}
+		@param pixels {Uint32Array} `width * height` premultiplied ARGB pixels
+		@return {Number}
+		Create an image cursor, X Window system only. Return cursor id for `setImageCursor()`.
+		**/
+		.set("createCursor", window_create_cursor_v8)
+		/**
+		@function setImageCursor(id)
+		@param id {Number}
+		Set window cursor loaded with `loadCursor()` or created with `createCursor()`,
+		X Window system only. Cursor changes are sent to the X server once in a main loop turn.
+		**/
+		.set("setImageCursor", &window::set_image_cursor)
+		/**
+		@function lockPointer()
+		@return {Boolean}
+		Lock the pointer in the window, X Window system only. The pointer is confined
+		to the window and hidden, `mousemove` events have unaccelerated relative motion
+		in `dx`, `dy` attributes and the last pointer position in `x`, `y`.
+		Return `false` if the pointer can't be locked.
+		**/
+		.set("lockPointer", &window::lock_pointer)
+		/**
+		@function unlockPointer()
+		Unlock the pointer locked with `lockPointer()`, X Window system only.
+		**/
+		.set("unlockPointer", &window::unlock_pointer)
 #endif
 		.set("show_frame", &window::show_frame)
 		.set("set_topmost", &window::set_topmost)
@@ -312,6 +886,222 @@ v8::Handle<v8::Value> oxygen_install(v8::Isolate* isolate)
 		;
 	oxygen_module.set("Window", window_class);
 
+	/**
+	@class VirtualWindow
+	Window without a native window, for load tests of event handling.
+	Events are delivered through the same queue and listener path as for `Window`.
+	@function VirtualWindow([options]) Constructor
+	@param [options] {Object}
+	Create a virtual window with `width` and `height` options, default size is 800x600.
+	Option `reuseEvents` is the same as for `Window`.
+	**/
+	v8pp::class_<virtual_window> virtual_window_class(isolate, v8pp::v8_args_ctor);
+	virtual_window_class
+		.inherit<v8_core::event_emitter>()
+		/**
+		@function destroy()
+		Stop event generator and replay.
+		**/
+		.set("destroy", &virtual_window::destroy)
+		/**
+		@function on(event, handler)
+		@param event {String}
+		@param handler {Function}
+		Set `handler` function for `event`, see `Window.on()`.
+		Event `generateend` is emitted when the generator has produced `count` events.
+		**/
+		.set("on", &virtual_window::on)
+		/**
+		@function off(event)
+		@param event {String}
+		Remove handler function for `event`.
+		**/
+		.set("off", &virtual_window::off)
+		/**
+		@function addListener(event, handler)
+		@function once(event, handler)
+		@function removeListener(event, handler)
+		@function removeAllListeners([event])
+		@function emit(event, args...)
+		See `Window.once()`
+		**/
+		.set("addListener", &virtual_window::on)
+		.set("once", &virtual_window::once_v8)
+		.set("removeListener", &virtual_window::remove_listener_v8)
+		.set("removeAllListeners", &virtual_window::remove_all_listeners_v8)
+		.set("emit", &virtual_window::emit_v8)
+		/**
+		@property id {Number} Window number, see `Window.id`
+		**/
+		.set("id", v8pp::property(&virtual_window::id))
+		/**
+		@property width {Number} Window width
+		**/
+		.set("width", v8pp::property(&virtual_window::width))
+		/**
+		@property height {Number} Window height
+		**/
+		.set("height", v8pp::property(&virtual_window::height))
+		/**
+		@property keyboardState {Uint32Array} Keyboard state, see `Window.keyboardState`
+		**/
+		.set("keyboardState", v8pp::property(&virtual_window::keyboard_state))
+		/**
+		@property pointerState {Int32Array} Pointer state, see `Window.pointerState`
+		**/
+		.set("pointerState", v8pp::property(&virtual_window::pointer_state))
+		/**
+		@function inject(event)
+		@param event {Object} Input event object, as passed to listeners
+		Deliver an input event to the window.
+		**/
+		.set("inject", &virtual_window::inject)
+		/**
+		@function resize(width, height)
+		@param width {Number}
+		@param height {Number}
+		Change window size and deliver `resize` event.
+		**/
+		.set("resize", &virtual_window::resize)
+		/**
+		@function generate([options])
+		@param [options] {Object}
+		Start producing synthetic input events in a native thread, replacing
+		the running generator. Options object attributes:
+		  * `type`   Input event type, default is `mousemove`. Supported types are `keydown`, `keyup`,
+		    `char`, `mousemove`, `mousewheel`, `mousedown`, `mouseup` and `mouseclick`, an error
+		    is thrown for other types
+		  * `rate`   Events per second, default `0` produces events as fast as possible
+		  * `count`  Number of events, default `0` produces events until `stopGenerator()`
+		**/
+		.set("generate", &virtual_window::generate)
+		/**
+		@function stopGenerator()
+		Stop the event generator.
+		**/
+		.set("stopGenerator", &virtual_window::stop_generator)
+		/**
+		@property generated {Number} Number of events produced by the generator
+		**/
+		.set("generated", v8pp::property(&virtual_window::generated))
+		/**
+		@function setQueuePolicy(type, policy)
+		See `Window.setQueuePolicy()`
+		**/
+		.set("setQueuePolicy", &virtual_window::set_queue_policy)
+		/**
+		@function setQueueLimit(limit)
+		See `Window.setQueueLimit()`
+		**/
+		.set("setQueueLimit", &virtual_window::set_queue_limit)
+		/**
+		@function queueStats()
+		See `Window.queueStats()`
+		**/
+		.set("queueStats", &virtual_window::queue_stats)
+		/**
+		@function gcStats()
+		See `Window.gcStats()`
+		**/
+		.set("gcStats", window_gc_stats_v8)
+		/**
+		@function replay(filename [, speed [, id]])
+		See `Window.replay()`
+		**/
+		.set("replay", &virtual_window::replay_v8)
+		/**
+		@function stopReplay()
+		Stop replay started with `replay()`.
+		**/
+		.set("stopReplay", &virtual_window::stop_replay)
+		/**
+		@function setRegions(regions)
+		See `Window.setRegions()`
+		**/
+		.set("setRegions", &virtual_window::set_regions)
+		/**
+		@function clearRegions()
+		Remove all hit-test regions.
+		**/
+		.set("clearRegions", &virtual_window::clear_regions)
+		/**
+		@function regionAt(x, y)
+		See `Window.regionAt()`
+		**/
+		.set("regionAt", &virtual_window::region_at)
+		;
+	oxygen_module.set("VirtualWindow", virtual_window_class);
+
+	/**
+	@class EventRoute
+	Receiver of chosen window event types in another isolate, i.e. in a worker
+	dedicated to input processing. Routed events have their own queue and are
+	emitted by the route instead of the window, other events stay with the window.
+	Window `keyboardState` and `pointerState` arrays are not available in the
+	route isolate, the routed input events carry the key, button, modifiers and
+	pointer position, so the route listeners track the state they need.
+	@function EventRoute(windowId, types) Constructor
+	@param windowId {Number} Window `id`
+	@param types {Array} Event type names, i.e. `['mousemove', 'mousedown', 'keydown']`
+	Start routing events of `types` from the window to this isolate.
+	An event type can be routed to one route at a time.
+	**/
+	v8pp::class_<event_route> event_route_class(isolate, v8pp::v8_args_ctor);
+	event_route_class
+		.inherit<v8_core::event_emitter>()
+		/**
+		@function close()
+		Stop routing, the window gets the events again.
+		**/
+		.set("close", &event_route::close)
+		/**
+		@function on(event, handler)
+		@param event {String}
+		@param handler {Function}
+		Set `handler` function for a routed `event`.
+		**/
+		.set("on", &event_route::on)
+		/**
+		@function off(event)
+		@param event {String}
+		Remove handler function for `event`.
+		**/
+		.set("off", &event_route::off)
+		/**
+		@function addListener(event, handler)
+		@function once(event, handler)
+		@function removeListener(event, handler)
+		@function removeAllListeners([event])
+		@function emit(event, args...)
+		See `Window.once()`
+		**/
+		.set("addListener", &event_route::on)
+		.set("once", &event_route::once_v8)
+		.set("removeListener", &event_route::remove_listener_v8)
+		.set("removeAllListeners", &event_route::remove_all_listeners_v8)
+		.set("emit", &event_route::emit_v8)
+		/**
+		@property windowId {Number} Source window `id`
+		**/
+		.set("windowId", v8pp::property(&event_route::window_id))
+		/**
+		@function setQueuePolicy(type, policy)
+		See `Window.setQueuePolicy()`
+		**/
+		.set("setQueuePolicy", &event_route::set_queue_policy)
+		/**
+		@function setQueueLimit(limit)
+		See `Window.setQueueLimit()`
+		**/
+		.set("setQueueLimit", &event_route::set_queue_limit)
+		/**
+		@function queueStats()
+		See `Window.queueStats()`
+		**/
+		.set("queueStats", &event_route::queue_stats)
+		;
+	oxygen_module.set("EventRoute", event_route_class);
+
 	/**
 	@module oxygen
 	@property styles Window styles. Contains following constants:
@@ -408,6 +1198,74 @@ v8::Handle<v8::Value> oxygen_install(v8::Isolate* isolate)
 #undef KEY
 	oxygen_module.set("keys", keys);
 
+	/**
+	@module oxygen
+	@property codes Physical key codes, independent from keyboard layout
+	(currently implemented in X Window system only). Named after
+	the US keyboard key in that location. Contains following values:
+	  * `UNKNOWN`
+	  * `ESCAPE`, `F1` - `F24`
+	  * `BACKQUOTE`, `DIGIT_0` - `DIGIT_9`, `MINUS`, `EQUAL`, `BACKSPACE`
+	  * `TAB`, `A` - `Z`
+	  * `BRACKET_LEFT`, `BRACKET_RIGHT`, `BACKSLASH`, `INTL_BACKSLASH`
+	  * `CAPS_LOCK`, `SEMICOLON`, `QUOTE`, `ENTER`
+	  * `COMMA`, `PERIOD`, `SLASH`
+	  * `SHIFT_LEFT`, `SHIFT_RIGHT`, `CONTROL_LEFT`, `CONTROL_RIGHT`
+	  * `ALT_LEFT`, `ALT_RIGHT`, `META_LEFT`, `META_RIGHT`, `CONTEXT_MENU`, `SPACE`
+	  * `PRINT_SCREEN`, `SCROLL_LOCK`, `PAUSE`
+	  * `INSERT`, `DELETE`, `HOME`, `END`, `PAGE_UP`, `PAGE_DOWN`
+	  * `ARROW_UP`, `ARROW_LEFT`, `ARROW_DOWN`, `ARROW_RIGHT`
+	  * `NUM_LOCK`, `NUMPAD_0` - `NUMPAD_9`
+	  * `NUMPAD_DIVIDE`, `NUMPAD_MULTIPLY`, `NUMPAD_SUBTRACT`, `NUMPAD_ADD`
+	  * `NUMPAD_ENTER`, `NUMPAD_DECIMAL`, `NUMPAD_EQUAL`
+	**/
+	v8pp::module codes(isolate);
+#define CODE(name) codes.set_const(#name, CODE_##name)
+	CODE(UNKNOWN);
+
+	CODE(ESCAPE);
+	CODE(F1); CODE(F2); CODE(F3); CODE(F4); CODE(F5); CODE(F6);
+	CODE(F7); CODE(F8); CODE(F9); CODE(F10); CODE(F11); CODE(F12);
+	CODE(F13); CODE(F14); CODE(F15); CODE(F16); CODE(F17); CODE(F18);
+	CODE(F19); CODE(F20); CODE(F21); CODE(F22); CODE(F23); CODE(F24);
+
+	CODE(BACKQUOTE);
+	CODE(DIGIT_0); CODE(DIGIT_1); CODE(DIGIT_2); CODE(DIGIT_3); CODE(DIGIT_4);
+	CODE(DIGIT_5); CODE(DIGIT_6); CODE(DIGIT_7); CODE(DIGIT_8); CODE(DIGIT_9);
+	CODE(MINUS); CODE(EQUAL); CODE(BACKSPACE);
+
+	CODE(A); CODE(B); CODE(C); CODE(D); CODE(E); CODE(F); CODE(G);
+	CODE(H); CODE(I); CODE(J); CODE(K); CODE(L); CODE(M); CODE(N);
+	CODE(O); CODE(P); CODE(Q); CODE(R); CODE(S); CODE(T); CODE(U);
+	CODE(V); CODE(W); CODE(X); CODE(Y); CODE(Z);
+
+	CODE(TAB); CODE(CAPS_LOCK); CODE(ENTER);
+	CODE(BRACKET_LEFT); CODE(BRACKET_RIGHT);
+	CODE(BACKSLASH); CODE(INTL_BACKSLASH);
+	CODE(SEMICOLON); CODE(QUOTE);
+	CODE(COMMA); CODE(PERIOD); CODE(SLASH);
+
+	CODE(SHIFT_LEFT); CODE(SHIFT_RIGHT);
+	CODE(CONTROL_LEFT); CODE(CONTROL_RIGHT);
+	CODE(ALT_LEFT); CODE(ALT_RIGHT);
+	CODE(META_LEFT); CODE(META_RIGHT);
+	CODE(CONTEXT_MENU); CODE(SPACE);
+
+	CODE(PRINT_SCREEN); CODE(SCROLL_LOCK); CODE(PAUSE);
+	CODE(INSERT); CODE(DELETE);
+	CODE(HOME); CODE(END);
+	CODE(PAGE_UP); CODE(PAGE_DOWN);
+	CODE(ARROW_UP); CODE(ARROW_LEFT); CODE(ARROW_DOWN); CODE(ARROW_RIGHT);
+
+	CODE(NUM_LOCK);
+	CODE(NUMPAD_0); CODE(NUMPAD_1); CODE(NUMPAD_2); CODE(NUMPAD_3); CODE(NUMPAD_4);
+	CODE(NUMPAD_5); CODE(NUMPAD_6); CODE(NUMPAD_7); CODE(NUMPAD_8); CODE(NUMPAD_9);
+	CODE(NUMPAD_DIVIDE); CODE(NUMPAD_MULTIPLY);
+	CODE(NUMPAD_SUBTRACT); CODE(NUMPAD_ADD);
+	CODE(NUMPAD_ENTER); CODE(NUMPAD_DECIMAL); CODE(NUMPAD_EQUAL);
+#undef CODE
+	oxygen_module.set("codes", codes);
+
 	/**
 	@module oxygen
 	@property cursors Window cursors. Contains following constants:
@@ -435,8 +1293,18 @@ v8::Handle<v8::Value> oxygen_install(v8::Isolate* isolate)
 void oxygen_uninstall(v8::Isolate* isolate, v8::Handle<v8::Value> library)
 {
 	(void)library;
+	stop_gc_stats(isolate);
+	clear_display_cache(isolate);
+	string_cache::clear(isolate);
+	v8pp::class_<event_route>::destroy_objects(isolate);
+	v8pp::class_<virtual_window>::destroy_objects(isolate);
 	v8pp::class_<window>::destroy_objects(isolate);
-	window::cleanup();
+
+	boost::mutex::scoped_lock lock(install_mutex);
+	if (--install_count == 0)
+	{
+		window::cleanup();
+	}
 }
 
 }} // ::aspect::gui
@@ -0,0 +1,185 @@
+#include "oxygen/oxygen.hpp"
+#include "oxygen/recorder.hpp"
+
+#include <iostream>
+
+namespace aspect { namespace gui {
+
+event_recorder::event_recorder(std::string const& filename)
+	: file_(fopen(filename.c_str(), "wb"))
+	, stopping_(false)
+	, start_(boost::chrono::steady_clock::now())
+	, count_(0)
+{
+	if (!file_)
+	{
+		throw std::runtime_error("can't create recording file " + filename);
+	}
+
+	uint32_t const header[2] = { event_record::MAGIC, event_record::VERSION };
+	if (fwrite(header, sizeof header, 1, file_) != 1)
+	{
+		fclose(file_);
+		throw std::runtime_error("can't write recording file " + filename);
+	}
+	buffer_.reserve(BUFFER_RECORDS);
+
+	writer_ = boost::thread(&event_recorder::write_buffers, this);
+}
+
+event_recorder::~event_recorder()
+{
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (!buffer_.empty())
+		{
+			full_buffers_.push_back(record_buffer());
+			full_buffers_.back().swap(buffer_);
+		}
+		stopping_ = true;
+	}
+	buffers_full_.notify_one();
+	writer_.join();
+	fclose(file_);
+}
+
+void event_recorder::append(event_record& record)
+{
+	record.time_us = boost::chrono::duration_cast<boost::chrono::microseconds>(
+		boost::chrono::steady_clock::now() - start_).count();
+
+	boost::mutex::scoped_lock lock(mutex_);
+	buffer_.push_back(record);
+	++count_;
+	if (buffer_.size() == BUFFER_RECORDS)
+	{
+		// Hand the full buffer to the writer, continue in a written one
+		full_buffers_.push_back(record_buffer());
+		full_buffers_.back().swap(buffer_);
+		if (!free_buffers_.empty())
+		{
+			buffer_.swap(free_buffers_.back());
+			free_buffers_.pop_back();
+		}
+		else
+		{
+			buffer_.reserve(BUFFER_RECORDS);
+		}
+		lock.unlock();
+		buffers_full_.notify_one();
+	}
+}
+
+void event_recorder::write_buffers()
+{
+	boost::mutex::scoped_lock lock(mutex_);
+	for (;;)
+	{
+		while (full_buffers_.empty() && !stopping_)
+		{
+			buffers_full_.wait(lock);
+		}
+		if (full_buffers_.empty())
+		{
+			return;
+		}
+
+		record_buffer buffer;
+		buffer.swap(full_buffers_.front());
+		full_buffers_.erase(full_buffers_.begin());
+
+		lock.unlock();
+		if (fwrite(buffer.data(), sizeof(event_record), buffer.size(), file_) != buffer.size())
+		{
+			std::cerr << "event recording write error" << std::endl;
+		}
+		buffer.clear();
+		lock.lock();
+
+		free_buffers_.push_back(record_buffer());
+		free_buffers_.back().swap(buffer);
+	}
+}
+
+event_player::event_player(window_base& target, std::string const& filename, double speed, uint32_t window_id)
+	: target_(target)
+	, file_(fopen(filename.c_str(), "rb"))
+	, speed_(speed)
+	, window_id_(window_id)
+	, finished_(false)
+{
+	if (!file_)
+	{
+		throw std::runtime_error("can't open recording file " + filename);
+	}
+
+	uint32_t header[2];
+	if (fread(header, sizeof header, 1, file_) != 1
+		|| header[0] != event_record::MAGIC || header[1] != event_record::VERSION)
+	{
+		fclose(file_);
+		throw std::runtime_error("unsupported recording file " + filename);
+	}
+
+	thread_ = boost::thread(&event_player::run, this);
+}
+
+event_player::~event_player()
+{
+	thread_.interrupt();
+	thread_.join();
+	fclose(file_);
+}
+
+void event_player::run()
+{
+	using namespace boost::chrono;
+
+	steady_clock::time_point const start = steady_clock::now();
+
+	event_record record;
+	try
+	{
+		while (fread(&record, sizeof record, 1, file_) == 1)
+		{
+			if (window_id_ && record.window != window_id_)
+			{
+				continue;
+			}
+
+			if (speed_ > 0)
+			{
+				boost::this_thread::sleep_until(start + microseconds(
+					static_cast<int64_t>(record.time_us / speed_)));
+			}
+			else
+			{
+				boost::this_thread::interruption_point();
+			}
+
+			if (record.type < input_event::EVENT_TYPE_COUNT)
+			{
+				target_.process_input(input_event::unpack(record.data));
+			}
+			else if (record.type == window_base::RESIZE_EVENT)
+			{
+				target_.process_resize(box<int>(record.data[0], record.data[1]));
+			}
+			else if (record.type != window_base::CLOSE_EVENT && record.type < window_base::LISTENER_TABLE_SIZE)
+			{
+				// don't close the target window
+				target_.process_event(static_cast<window_base::window_event>(record.type));
+			}
+		}
+	}
+	catch (boost::thread_interrupted const&)
+	{
+		return;
+	}
+
+	finished_ = true;
+	target_.replaying_ = false;
+	target_.on_event("replayend");
+}
+
+}} // aspect::gui